@@ -0,0 +1,206 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Packed asset archive
+ */
+#include "archive.h"
+#include "mapfile.h"
+#include "gl.h"
+#include "sound.h"
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+namespace {
+
+const char ARCHIVE_MAGIC[8] = {'S', 'E', 'K', 'O', 'P', 'A', 'K', '2'};
+const size_t ARCHIVE_ALIGN = 16;
+
+MappedFile *archive = NULL;
+std::map<std::string, Asset> assets;
+
+/* Of the loose file an asset was packed from */
+struct Stamp {
+	uint64_t size;
+	int64_t mtime;
+};
+
+struct Entry {
+	std::string name;
+	AssetType type;
+	Stamp stamp;
+	std::string data;
+};
+
+bool get_stamp(Stamp *stamp, const char *fname)
+{
+	struct stat st;
+	if (stat(fname, &st) < 0)
+		return false;
+	stamp->size = st.st_size;
+	stamp->mtime = st.st_mtime;
+	return true;
+}
+
+bool has_suffix(const std::string &s, const char *suffix)
+{
+	size_t len = strlen(suffix);
+	return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+void align(std::string *out)
+{
+	out->resize((out->size() + ARCHIVE_ALIGN - 1) & ~(ARCHIVE_ALIGN - 1),
+		    0);
+}
+
+/* False if packed by another version */
+bool read_toc()
+{
+	Asset whole;
+	whole.type = ASSET_FILE;
+	whole.data = archive->data();
+	whole.size = archive->size();
+	AssetReader reader(&whole);
+	if (memcmp(reader.skip(sizeof ARCHIVE_MAGIC), ARCHIVE_MAGIC,
+		   sizeof ARCHIVE_MAGIC)) {
+		return false;
+	}
+	uint32_t count = reader.get<uint32_t>();
+	for (uint32_t i = 0; i < count; ++i) {
+		std::string name = reader.get_string();
+		Asset asset;
+		asset.type = AssetType(reader.get<uint32_t>());
+		Stamp packed = reader.get<Stamp>();
+		uint64_t offset = reader.get<uint64_t>();
+		uint64_t size = reader.get<uint64_t>();
+		if (offset > whole.size || size > whole.size - offset) {
+			throw std::runtime_error("Corrupted archive");
+		}
+		/* an edited loose file wins, a missing one does not */
+		Stamp loose;
+		if (get_stamp(&loose, name.c_str()) &&
+		    (loose.size != packed.size || loose.mtime != packed.mtime)) {
+			warning("%s changed since it was packed, "
+				"using the loose file\n", name.c_str());
+			continue;
+		}
+		asset.data = whole.data + offset;
+		asset.size = size;
+		ins(assets, name, asset);
+	}
+	return true;
+}
+
+}
+
+bool open_archive(const char *fname)
+{
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL)
+		return false;
+	fclose(f);
+
+	archive = new MappedFile(fname);
+	bool ok;
+	try {
+		ok = read_toc();
+	} catch (...) {
+		assets.clear();
+		delete archive;
+		archive = NULL;
+		throw;
+	}
+	if (!ok) {
+		warning("%s is from another version, using the loose files\n",
+			fname);
+		delete archive;
+		archive = NULL;
+		return false;
+	}
+	debug("%zd assets in %s\n", assets.size(), fname);
+	return true;
+}
+
+const Asset *find_asset(const std::string &name, AssetType type)
+{
+	std::map<std::string, Asset>::const_iterator i = assets.find(name);
+	if (i == assets.end() || i->second.type != type)
+		return NULL;
+	return &i->second;
+}
+
+void build_archive(const char *fname)
+{
+	DIR *dir = opendir(".");
+	if (dir == NULL) {
+		throw std::runtime_error("Can not list the data directory");
+	}
+	std::vector<std::string> names;
+	while (struct dirent *ent = readdir(dir)) {
+		names.push_back(ent->d_name);
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	std::vector<Entry> entries;
+	FOR_EACH_CONST(std::vector<std::string>, i, names) {
+		Entry entry;
+		entry.name = *i;
+		if (!get_stamp(&entry.stamp, i->c_str())) {
+			continue;
+		} else if (has_suffix(*i, ".png")) {
+			entry.type = ASSET_IMAGE;
+			pack_image(i->c_str(), &entry.data);
+		} else if (has_suffix(*i, ".obj")) {
+			/* materials are folded into the mesh */
+			entry.type = ASSET_MESH;
+			pack_mesh(i->c_str(), &entry.data);
+		} else if (has_suffix(*i, ".ogg")) {
+			pack_sound(i->c_str(), &entry.type, &entry.data);
+		} else if (has_suffix(*i, ".ttf")) {
+			GLFont font;
+			entry.type = ASSET_FONT;
+			entry.data = font.bake(i->c_str());
+		} else {
+			continue;
+		}
+		printf("%s: %zd bytes\n", i->c_str(), entry.data.size());
+		entries.push_back(entry);
+	}
+
+	std::string toc;
+	toc.append(ARCHIVE_MAGIC, sizeof ARCHIVE_MAGIC);
+	put(&toc, uint32_t(entries.size()));
+	FOR_EACH_CONST(std::vector<Entry>, i, entries) {
+		put_string(&toc, i->name);
+		put(&toc, uint32_t(i->type));
+		put(&toc, i->stamp);
+		/* offsets are filled in below */
+		put(&toc, uint64_t(0));
+		put(&toc, uint64_t(i->data.size()));
+	}
+
+	std::string out = toc;
+	size_t pos = sizeof ARCHIVE_MAGIC + sizeof(uint32_t);
+	FOR_EACH_CONST(std::vector<Entry>, i, entries) {
+		align(&out);
+		pos += sizeof(uint32_t) + i->name.size() + sizeof(uint32_t) +
+			sizeof(Stamp);
+		uint64_t offset = out.size();
+		memcpy(&out[pos], &offset, sizeof offset);
+		pos += 2 * sizeof(uint64_t);
+		out.append(i->data);
+	}
+
+	if (!write_file(fname, out)) {
+		throw std::runtime_error(strf("Can not write: %s", fname));
+	}
+	printf("%zd assets, %zd bytes\n", entries.size(), out.size());
+}
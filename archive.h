@@ -0,0 +1,80 @@
+#ifndef __archive_h
+#define __archive_h
+
+#include "utils.h"
+#include <string.h>
+#include <stdexcept>
+
+enum AssetType {
+	ASSET_FILE,
+	ASSET_IMAGE,
+	ASSET_MESH,
+	ASSET_SOUND,
+	ASSET_FONT,
+};
+
+/* Payload inside the mapped archive, aligned to 16 bytes */
+struct Asset {
+	AssetType type;
+	const char *data;
+	size_t size;
+};
+
+/* Reads the payload formats, throws if it runs past the end */
+class AssetReader {
+public:
+	AssetReader(const Asset *asset) :
+		m_pos(asset->data), m_end(asset->data + asset->size)
+	{}
+
+	template<class T>
+	T get()
+	{
+		T v;
+		memcpy(&v, skip(sizeof v), sizeof v);
+		return v;
+	}
+
+	std::string get_string()
+	{
+		uint32_t len = get<uint32_t>();
+		return std::string(skip(len), len);
+	}
+
+	const char *skip(size_t len)
+	{
+		if (len > size_t(m_end - m_pos)) {
+			throw std::runtime_error("Corrupted archive");
+		}
+		const char *p = m_pos;
+		m_pos += len;
+		return p;
+	}
+
+private:
+	const char *m_pos, *m_end;
+};
+
+template<class T>
+void put(std::string *out, const T &v)
+{
+	out->append((const char *) &v, sizeof v);
+}
+
+inline void put_string(std::string *out, const std::string &s)
+{
+	put(out, uint32_t(s.size()));
+	out->append(s);
+}
+
+/*
+ * Loaders look here first once an archive is open. Assets whose loose file
+ * changed since packing are left out, so the file is loaded instead.
+ */
+bool open_archive(const char *fname);
+const Asset *find_asset(const std::string &name, AssetType type);
+
+/* Packs the assets of the current directory */
+void build_archive(const char *fname);
+
+#endif
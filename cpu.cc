@@ -0,0 +1,246 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * CPU feature detection and kernel dispatch
+ */
+#include "cpu.h"
+#include "utils.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+#include <vector>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+Kernels kernels = kernels_generic;
+
+namespace {
+
+const char *level_names[NUM_CPU_LEVELS] = {
+	"generic", "sse2", "avx2", "avx512",
+};
+
+const Kernels *level_kernels[NUM_CPU_LEVELS] = {
+	&kernels_generic, &kernels_sse2, &kernels_avx2, &kernels_avx512,
+};
+
+/* Enough to cover the vector loops and their scalar tails */
+const size_t TEST_COUNT = 1000 + 13;
+const float TOLERANCE = 1e-5;
+
+/* Big enough to leave the call overhead out, small enough for the cache */
+const size_t BENCH_COUNT = 16384;
+const int BENCH_ROUNDS = 1000;
+
+/* About the bones of a skeleton */
+const int SKIN_BONES = 20;
+
+/* Random bone frames and attachments for the skinning kernel */
+struct SkinData {
+	size_t count;
+	std::vector<int> bone;
+	std::vector<float> frame[12], coef[7], out[6];
+
+	SkinData(size_t i_count) :
+		count(i_count)
+	{
+		for (int i = 0; i < 12; ++i) {
+			frame[i].resize(SKIN_BONES);
+			uniform_fill(&frame[i][0], SKIN_BONES);
+		}
+		for (int i = 0; i < 7; ++i) {
+			coef[i].resize(count);
+			uniform_fill(&coef[i][0], count);
+		}
+		for (int i = 0; i < 6; ++i) {
+			out[i].assign(count, 0);
+		}
+		for (size_t i = 0; i < count; ++i) {
+			bone.push_back(random_u64() % SKIN_BONES);
+		}
+	}
+
+	void run(const Kernels *k)
+	{
+		const float *frame_p[12], *coef_p[7];
+		float *out_p[6];
+		for (int i = 0; i < 12; ++i)
+			frame_p[i] = &frame[i][0];
+		for (int i = 0; i < 7; ++i)
+			coef_p[i] = &coef[i][0];
+		for (int i = 0; i < 6; ++i)
+			out_p[i] = &out[i][0];
+		k->skin(count, &bone[0], frame_p, coef_p, out_p);
+	}
+};
+
+struct TestData {
+	std::vector<float> v[7];
+	std::vector<int16_t> buf, data;
+	SkinData skin;
+
+	TestData() :
+		skin(TEST_COUNT)
+	{
+		for (int i = 0; i < 7; ++i) {
+			v[i].resize(TEST_COUNT);
+			uniform_fill(&v[i][0], TEST_COUNT);
+		}
+		for (size_t i = 0; i < TEST_COUNT; ++i) {
+			buf.push_back(int(random_u64() & 0xffff) - 0x8000);
+			data.push_back(int(random_u64() & 0xffff) - 0x8000);
+		}
+	}
+
+	void run(const Kernels *k)
+	{
+		k->integrate(TEST_COUNT, 0.02, &v[0][0], &v[1][0], &v[2][0],
+			     &v[3][0], &v[4][0], &v[5][0], &v[6][0]);
+		skin.run(k);
+		/* a volume above 256 exercises the clamping too */
+		k->mix_audio(&buf[0], &data[0], TEST_COUNT / 2, 256);
+		k->mix_audio(&buf[TEST_COUNT / 2], &data[0],
+			     TEST_COUNT - TEST_COUNT / 2, 700);
+	}
+
+	bool matches(const TestData &o) const
+	{
+		for (int i = 0; i < 7; ++i) {
+			for (size_t j = 0; j < TEST_COUNT; ++j) {
+				if (fabs(v[i][j] - o.v[i][j]) > TOLERANCE)
+					return false;
+			}
+		}
+		for (int i = 0; i < 6; ++i) {
+			for (size_t j = 0; j < TEST_COUNT; ++j) {
+				if (fabs(skin.out[i][j] - o.skin.out[i][j]) >
+				    TOLERANCE)
+					return false;
+			}
+		}
+		return buf == o.buf;
+	}
+};
+
+}
+
+CPULevel detect_cpu()
+{
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") &&
+	    __builtin_cpu_supports("avx512bw"))
+		return CPU_AVX512;
+	if (__builtin_cpu_supports("avx2"))
+		return CPU_AVX2;
+	if (__builtin_cpu_supports("sse2"))
+		return CPU_SSE2;
+#endif
+	return CPU_GENERIC;
+}
+
+/* Online logical processors, at least one */
+int num_cpus()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return std::max(int(info.dwNumberOfProcessors), 1);
+#else
+	return std::max(int(sysconf(_SC_NPROCESSORS_ONLN)), 1);
+#endif
+}
+
+CPULevel parse_cpu_level(const char *name)
+{
+	for (int i = 0; i < NUM_CPU_LEVELS; ++i) {
+		if (strcmp(name, level_names[i]) == 0)
+			return CPULevel(i);
+	}
+	throw std::runtime_error(strf("Unknown CPU level: %s", name));
+}
+
+const char *cpu_level_name(CPULevel level)
+{
+	return level_names[level];
+}
+
+void init_kernels(CPULevel level)
+{
+	if (level > detect_cpu()) {
+		throw std::runtime_error(strf("This CPU does not support %s",
+					      level_names[level]));
+	}
+	kernels = *level_kernels[level];
+	debug("using %s kernels\n", level_names[level]);
+}
+
+/* Runs every variant this CPU can, and compares to the generic one */
+bool kernel_selftest()
+{
+	TestData reference;
+	TestData input = reference;
+	reference.run(&kernels_generic);
+
+	bool ok = true;
+	for (int i = CPU_GENERIC + 1; i <= detect_cpu(); ++i) {
+		TestData test = input;
+		test.run(level_kernels[i]);
+		bool match = test.matches(reference);
+		printf("%s: %s\n", level_names[i], match ? "ok" : "MISMATCH");
+		ok = ok && match;
+	}
+	return ok;
+}
+
+/* Time per element of each kernel, for every variant this CPU can run */
+void kernel_benchmark()
+{
+	for (int i = CPU_GENERIC; i <= detect_cpu(); ++i) {
+		const Kernels *k = level_kernels[i];
+		std::vector<float> v[7];
+		for (int j = 0; j < 7; ++j) {
+			v[j].resize(BENCH_COUNT);
+			uniform_fill(&v[j][0], BENCH_COUNT);
+		}
+		std::vector<int16_t> buf(BENCH_COUNT), data(BENCH_COUNT);
+		for (size_t j = 0; j < BENCH_COUNT; ++j) {
+			data[j] = int(random_u64() & 0xffff) - 0x8000;
+		}
+
+		double start = wall_time();
+		for (int round = 0; round < BENCH_ROUNDS; ++round) {
+			k->integrate(BENCH_COUNT, 0.001, &v[0][0], &v[1][0],
+				     &v[2][0], &v[3][0], &v[4][0], &v[5][0],
+				     &v[6][0]);
+		}
+		double integrate = wall_time() - start;
+
+		start = wall_time();
+		for (int round = 0; round < BENCH_ROUNDS; ++round) {
+			k->mix_audio(&buf[0], &data[0], BENCH_COUNT, 200);
+		}
+		double mix = wall_time() - start;
+
+		SkinData skin(BENCH_COUNT);
+		start = wall_time();
+		for (int round = 0; round < BENCH_ROUNDS; ++round) {
+			skin.run(k);
+		}
+		double skinning = wall_time() - start;
+
+		double scale = 1e9 / (double(BENCH_COUNT) * BENCH_ROUNDS);
+		printf("%-8s integrate %6.3f ns, mix_audio %6.3f ns, "
+		       "skin %6.3f ns\n", level_names[i], integrate * scale,
+		       mix * scale, skinning * scale);
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef __cpu_h
+#define __cpu_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum CPULevel {
+	CPU_GENERIC,
+	CPU_SSE2,
+	CPU_AVX2,
+	CPU_AVX512,
+	NUM_CPU_LEVELS
+};
+
+/*
+ * Hot loops, built once per instruction set (see kernels.inc) and picked
+ * at startup by init_kernels().
+ */
+struct Kernels {
+	void (*integrate)(size_t count, float dt, float *x, float *y,
+			  float *z, float *vx, float *vy, float *vz,
+			  float *time);
+	/*
+	 * Adds one attachment slot of every vertex: frame holds 12 arrays
+	 * by bone (a, d, up, perp), coef 7 by vertex (x, u, v, nx, nu, nv,
+	 * w) and out 6 by vertex (pos, normal).
+	 */
+	void (*skin)(size_t count, const int *bone, const float *const *frame,
+		     const float *const *coef, float *const *out);
+	/* Adds data scaled by volume / 256, saturating */
+	void (*mix_audio)(int16_t *buf, const int16_t *data, size_t count,
+			  int volume);
+};
+
+extern Kernels kernels;
+
+extern const Kernels kernels_generic;
+extern const Kernels kernels_sse2;
+extern const Kernels kernels_avx2;
+extern const Kernels kernels_avx512;
+
+CPULevel detect_cpu();
+int num_cpus();
+CPULevel parse_cpu_level(const char *name);
+const char *cpu_level_name(CPULevel level);
+void init_kernels(CPULevel level);
+bool kernel_selftest();
+void kernel_benchmark();
+
+#endif
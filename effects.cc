@@ -11,6 +11,11 @@
  */
 #include "effects.h"
 #include "gl.h"
+#include "framegraph.h"
+#include "particles.h"
+#include "gpuparticles.h"
+#include "sprites.h"
+#include "resources.h"
 #include <SDL.h>
 
 extern SDL_Surface *screen;
@@ -19,184 +24,450 @@ namespace {
 
 const size_t FOG_COUNT = 500;
 vec3 fog[FOG_COUNT];
-FBO bloom1, bloom2, bloom_out;
+bool fog_placed = false;
+
+const int MAX_BLOOM_LEVELS = 8;
+const int MIN_BLOOM_SIZE = 8;
+const double BLOOM_INTENSITY = 1.0;
+
+RenderTargetPool render_targets;
 
 const Color white(1, 1, 1);
 
-struct Particle {
-	Color color;
-	double time, duration, size;
-	vec3 pos, vel;
+struct SceneFunc {
+	void (*draw)();
+	bool defer_particles;
 };
 
-std::list<Particle> smoke;
+struct DeferredParticles {
+	bool enabled;
+	bool smoke, fog;
+	GLdouble modelview[16], projection[16];
+};
 
-}
+DeferredParticles deferred;
 
-void draw_number(vec2 pos, int v, int len)
-{
-	static GLuint digits = INVALID_TEXTURE;
-	if (digits == INVALID_TEXTURE) {
-		digits = load_png("digits.png");
-	}
+/* Drawing into the particle target */
+bool offscreen = false;
 
-	assert(v >= 0);
+/* With GPU particles, this only collects new ones until the next step */
+ParticlePool smoke;
+GPUParticles gpu_smoke;
+/* smoke and fog, released with the level */
+TextureHandle smoke_tex;
 
-	GLState state;
-	state.enable(GL_BLEND);
-	state.enable(GL_TEXTURE_2D);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glBindTexture(GL_TEXTURE_2D, digits);
+struct Billboard {
+	float pos[3];
+	float size;
+	float color[4];
+};
 
-	glBegin(GL_QUADS);
-	pos.x += DIGIT_WIDTH * len;
-	for (int i = 0; i < len; ++i) {
-		pos.x -= DIGIT_WIDTH;
+std::vector<Billboard> billboards, fog_billboards;
 
-		float x = (v % 10) * DIGIT_WIDTH / 512;
-		glTexCoord2f(x, 0);
-		glVertex3f(pos.x, pos.y, 0);
-		glTexCoord2f(x, 1.0);
-		glVertex3f(pos.x, pos.y + DIGIT_HEIGHT, 0);
-		glTexCoord2f(x + DIGIT_WIDTH / 512, 1.0);
-		glVertex3f(pos.x + DIGIT_WIDTH, pos.y + DIGIT_HEIGHT, 0);
-		glTexCoord2f(x + DIGIT_WIDTH / 512, 0);
-		glVertex3f(pos.x + DIGIT_WIDTH, pos.y, 0);
+/* Quads are expanded in view space, so they always face the camera */
+const char *billboard_vs =
+"attribute vec2 corner;\
+attribute vec4 center;\
+attribute vec4 color;\
+varying vec2 tc;\
+varying vec4 col;\
+void main(void)\
+{\
+	vec4 eye = gl_ModelViewMatrix * vec4(center.xyz, 1.0);\
+	eye.xy += corner * center.w;\
+	gl_Position = gl_ProjectionMatrix * eye;\
+	tc = corner * 0.5 + vec2(0.5);\
+	col = color;\
+}";
 
-		v /= 10;
-	}
-	glEnd();
-}
+/* Alpha-only texture, like GL_MODULATE with GL_ALPHA */
+const char *billboard_fs =
+"uniform sampler2D tex;\
+varying vec2 tc;\
+varying vec4 col;\
+void main(void)\
+{\
+	gl_FragColor = vec4(col.rgb, col.a * texture2D(tex, tc).a);\
+}";
 
-void move_smoke(double full_dt)
+bool use_instancing()
 {
-	const double MAX_STEP = 0.02;
-
-	while (full_dt > 0) {
-		double dt = std::min(full_dt, MAX_STEP);
-
-		FOR_EACH_SAFE(std::list<Particle>, p, smoke) {
-			vec3 accel = p->vel * -0.1 + vec3(0, 1, 0);
-			if (uniform() < dt) {
-				vec3 random = vec3(uniform(), uniform(), uniform()) -
-				      vec3(0.5, 0.5, 0.5);
-				accel += random;
-			}
-			p->pos += p->vel * dt;
-			p->vel += accel * dt;
-			p->time += dt;
-			if (p->time > p->duration) {
-				smoke.erase(p);
-			}
-		}
-		full_dt -= MAX_STEP;
-	}
+	return GLEW_VERSION_2_0 && GLEW_ARB_instanced_arrays &&
+	       GLEW_ARB_draw_instanced;
 }
 
-void draw_smoke()
+/* One instanced draw call from a streamed buffer */
+void draw_instanced(const std::vector<Billboard> &list)
 {
-	static GLuint smoke_tex = INVALID_TEXTURE;
-	if (smoke_tex == INVALID_TEXTURE) {
-		smoke_tex = load_png("smoke.png");
+	static GLuint program, corners, instances;
+	static GLint corner_attr, center_attr, color_attr;
+	if (program == 0) {
+		program = load_program(billboard_vs, billboard_fs, "corner");
+		corner_attr = glGetAttribLocation(program, "corner");
+		center_attr = glGetAttribLocation(program, "center");
+		color_attr = glGetAttribLocation(program, "color");
+
+		const float quad[] = {-1, -1, 1, -1, 1, 1, -1, 1};
+		glGenBuffers(1, &corners);
+		glBindBuffer(GL_ARRAY_BUFFER, corners);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad,
+			     GL_STATIC_DRAW);
+		glGenBuffers(1, &instances);
 	}
 
+	glUseProgram(program);
+
+	glBindBuffer(GL_ARRAY_BUFFER, corners);
+	glVertexAttribPointer(corner_attr, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(corner_attr);
+
+	/* orphan the old storage so the driver need not wait for it */
+	glBindBuffer(GL_ARRAY_BUFFER, instances);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(Billboard) * list.size(), NULL,
+		     GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(Billboard) * list.size(),
+			&list[0]);
+	const Billboard *b = NULL;
+	glVertexAttribPointer(center_attr, 4, GL_FLOAT, GL_FALSE,
+			      sizeof(Billboard), b->pos);
+	glVertexAttribPointer(color_attr, 4, GL_FLOAT, GL_FALSE,
+			      sizeof(Billboard), b->color);
+	glVertexAttribDivisorARB(center_attr, 1);
+	glVertexAttribDivisorARB(color_attr, 1);
+	glEnableVertexAttribArray(center_attr);
+	glEnableVertexAttribArray(color_attr);
+
+	glDrawArraysInstancedARB(GL_TRIANGLE_FAN, 0, 4, list.size());
+
+	glVertexAttribDivisorARB(center_attr, 0);
+	glVertexAttribDivisorARB(color_attr, 0);
+	glDisableVertexAttribArray(corner_attr);
+	glDisableVertexAttribArray(center_attr);
+	glDisableVertexAttribArray(color_attr);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glUseProgram(0);
+}
+
+/* Without instancing, expand on the CPU along the camera axes */
+void draw_immediate(const std::vector<Billboard> &list)
+{
 	GLdouble mdl[16];
 	glGetDoublev(GL_MODELVIEW_MATRIX, mdl);
+	vec3 right(mdl[0], mdl[4], mdl[8]);
+	vec3 up(mdl[1], mdl[5], mdl[9]);
 
-	vec3 camera;
-	camera.x = -(mdl[0] * mdl[12] + mdl[1] * mdl[13] + mdl[2] * mdl[14]);
-	camera.y = -(mdl[4] * mdl[12] + mdl[5] * mdl[13] + mdl[6] * mdl[14]);
-	camera.z = -(mdl[8] * mdl[12] + mdl[9] * mdl[13] + mdl[10] * mdl[14]);
-
-	GLState state;
-	state.enable(GL_BLEND);
-	state.enable(GL_DEPTH_TEST);
-	state.enable(GL_TEXTURE_2D);
-	glDepthMask(GL_FALSE);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glBindTexture(GL_TEXTURE_2D, smoke_tex);
 	glBegin(GL_QUADS);
+	FOR_EACH_CONST(std::vector<Billboard>, b, list) {
+		vec3 pos(b->pos[0], b->pos[1], b->pos[2]);
+		vec3 a = right * b->size;
+		vec3 c = up * b->size;
 
-	FOR_EACH_CONST (std::list<Particle>, p, smoke) {
-		vec3 n = normalize(camera - p->pos);
-		vec3 a = normalize(cross(n, vec3(0, 1, 0)))
-			 * (p->time / p->duration * p->size);
-		vec3 b = cross(a, n);
-
-		Color c = p->color;
-		c.a *= 1 - p->time / p->duration;
-		glColor(c);
+		glColor4fv(b->color);
 		glTexCoord2f(0, 0);
-		glVertex(p->pos - a - b);
+		glVertex(pos - a - c);
 		glTexCoord2f(1, 0);
-		glVertex(p->pos - a + b);
+		glVertex(pos + a - c);
 		glTexCoord2f(1, 1);
-		glVertex(p->pos + a + b);
+		glVertex(pos + a + c);
 		glTexCoord2f(0, 1);
-		glVertex(p->pos + a - b);
+		glVertex(pos - a + c);
 	}
-
 	glEnd();
+}
+
+bool use_gpu_particles()
+{
+	return gpu_particles && GLEW_VERSION_3_0 && use_instancing();
+}
+
+void setup_billboards(GLState *state, GLuint texture)
+{
+	state->enable(GL_BLEND);
+	state->enable(GL_DEPTH_TEST);
+	state->enable(GL_TEXTURE_2D);
+	glDepthMask(GL_FALSE);
+	if (offscreen) {
+		/* colour goes over, alpha keeps the product of (1 - a) */
+		glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA,
+				    GL_ZERO, GL_ONE_MINUS_SRC_ALPHA);
+	} else {
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+void draw_billboards(const std::vector<Billboard> &list, GLuint texture)
+{
+	if (list.empty())
+		return;
+
+	GLState state;
+	setup_billboards(&state, texture);
+
+	if (use_instancing()) {
+		draw_instanced(list);
+	} else {
+		draw_immediate(list);
+	}
 	glDepthMask(GL_TRUE);
 }
 
-void move_fog(double dt)
+void render_smoke()
 {
-	for (size_t i = 0; i < FOG_COUNT; ++i) {
-		fog[i].x += dt;
-		if (fog[i].x > 50) {
-			fog[i].x -= 100;
-		}
+	if (smoke_tex.empty()) {
+		load_effects();
+		billboards.reserve(MAX_PARTICLES);
+	}
+
+	if (use_gpu_particles()) {
+		GLState state;
+		setup_billboards(&state, smoke_tex.get());
+		gpu_smoke.draw();
+		glDepthMask(GL_TRUE);
+		return;
 	}
+
+	billboards.resize(smoke.count);
+	for (size_t i = 0; i < smoke.count; ++i) {
+		float age = smoke.time[i] / smoke.duration[i];
+		Billboard *b = &billboards[i];
+		b->pos[0] = smoke.x[i];
+		b->pos[1] = smoke.y[i];
+		b->pos[2] = smoke.z[i];
+		b->size = age * smoke.size[i];
+		b->color[0] = smoke.r[i];
+		b->color[1] = smoke.g[i];
+		b->color[2] = smoke.b[i];
+		b->color[3] = smoke.a[i] * (1 - age);
+	}
+	draw_billboards(billboards, smoke_tex.get());
 }
 
-void draw_fog()
+void render_fog()
 {
-	static GLuint smoke_tex = INVALID_TEXTURE;
-	if (smoke_tex == INVALID_TEXTURE) {
-		smoke_tex = load_png("smoke.png");
+	if (smoke_tex.empty()) {
+		load_effects();
+	}
+	if (!fog_placed) {
 		for (size_t i = 0; i < FOG_COUNT; ++i) {
 			fog[i] = vec3(uniform() * 100 - 50, uniform() * 20,
 				      uniform() * 100 - 50);
 		}
+		fog_placed = true;
 	}
 
-	GLdouble mdl[16];
-	glGetDoublev(GL_MODELVIEW_MATRIX, mdl);
+	const Color c(0, 0.01, 0.03, 0.1);
+	fog_billboards.resize(FOG_COUNT);
+	for (size_t i = 0; i < FOG_COUNT; ++i) {
+		Billboard *b = &fog_billboards[i];
+		b->pos[0] = fog[i].x;
+		b->pos[1] = fog[i].y;
+		b->pos[2] = fog[i].z;
+		b->size = 5;
+		b->color[0] = c.r;
+		b->color[1] = c.g;
+		b->color[2] = c.b;
+		b->color[3] = c.a;
+	}
+	draw_billboards(fog_billboards, smoke_tex.get());
+}
 
-	vec3 camera;
-	camera.x = -(mdl[0] * mdl[12] + mdl[1] * mdl[13] + mdl[2] * mdl[14]);
-	camera.y = -(mdl[4] * mdl[12] + mdl[5] * mdl[13] + mdl[6] * mdl[14]);
-	camera.z = -(mdl[8] * mdl[12] + mdl[9] * mdl[13] + mdl[10] * mdl[14]);
+/* Holds back particles drawn in the scene pass to be drawn offscreen */
+bool defer_particles(bool *flag)
+{
+	if (!deferred.enabled)
+		return false;
+	*flag = true;
+	glGetDoublev(GL_MODELVIEW_MATRIX, deferred.modelview);
+	glGetDoublev(GL_PROJECTION_MATRIX, deferred.projection);
+	return true;
+}
+
+struct Blit {
+	int src;
+	GLenum filter;
+};
+
+struct BloomPass {
+	int src;
+	GLuint program;
+	double intensity;
+};
+
+struct ParticlePass {
+	int scene, particles;
+};
+
+void scene_pass(const FrameGraph *graph, void *data)
+{
+	UNUSED(graph);
+	const SceneFunc *func = (const SceneFunc *) data;
+	deferred.enabled = func->defer_particles;
+	deferred.smoke = false;
+	deferred.fog = false;
+	func->draw();
+	deferred.enabled = false;
+}
+
+/*
+ * Particles against a point sampled copy of the scene depth. Colour is
+ * premultiplied and alpha is how much of the scene still shows through.
+ */
+void particle_pass(const FrameGraph *graph, void *data)
+{
+	const ParticlePass *pass = (const ParticlePass *) data;
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, graph->fbo(pass->scene));
+	glBlitFramebufferEXT(0, 0, graph->width(pass->scene),
+			     graph->height(pass->scene),
+			     0, 0, viewport[2], viewport[3],
+			     GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+	GLfloat clear[4];
+	glGetFloatv(GL_COLOR_CLEAR_VALUE, clear);
+	glClearColor(0, 0, 0, 1);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glClearColor(clear[0], clear[1], clear[2], clear[3]);
+
+	glMatrixMode(GL_PROJECTION);
+	glLoadMatrixd(deferred.projection);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadMatrixd(deferred.modelview);
+
+	offscreen = true;
+	if (deferred.smoke) {
+		render_smoke();
+	}
+	if (deferred.fog) {
+		render_fog();
+	}
+	offscreen = false;
+}
+
+void composite_particles_pass(const FrameGraph *graph, void *data)
+{
+	const ParticlePass *pass = (const ParticlePass *) data;
+	glColor(white);
 
 	GLState state;
 	state.enable(GL_BLEND);
-	state.enable(GL_DEPTH_TEST);
-	state.enable(GL_TEXTURE_2D);
-	glDepthMask(GL_FALSE);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glBindTexture(GL_TEXTURE_2D, smoke_tex);
-	glBegin(GL_QUADS);
+	state.enable(GL_TEXTURE_RECTANGLE_ARB);
+	glBlendFunc(GL_ONE, GL_SRC_ALPHA);
+	draw_target(graph, pass->particles);
+}
+
+/* Copies the source over the whole output of the pass */
+void blit_pass(const FrameGraph *graph, void *data)
+{
+	const Blit *blit = (const Blit *) data;
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	glBindFramebufferEXT(GL_READ_FRAMEBUFFER_EXT, graph->fbo(blit->src));
+	glBlitFramebufferEXT(0, 0, graph->width(blit->src),
+			     graph->height(blit->src),
+			     0, 0, viewport[2], viewport[3],
+			     GL_COLOR_BUFFER_BIT, blit->filter);
+}
+
+void downsample_pass(const FrameGraph *graph, void *data)
+{
+	const BloomPass *pass = (const BloomPass *) data;
+	glUseProgram(pass->program);
+	draw_target(graph, pass->src);
+	glUseProgram(0);
+}
+
+void upsample_pass(const FrameGraph *graph, void *data)
+{
+	const BloomPass *pass = (const BloomPass *) data;
+	GLState state;
+	state.enable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE);
+	glUseProgram(pass->program);
+	draw_target(graph, pass->src);
+	glUseProgram(0);
+}
 
-	Color c(0, 0.01, 0.03, 0.1);
+void add_bloom_pass(const FrameGraph *graph, void *data)
+{
+	const BloomPass *pass = (const BloomPass *) data;
+	Color c(1, 1, 1, pass->intensity);
 	glColor(c);
-	for (size_t i = 0; i < FOG_COUNT; ++i) {
-		vec3 n = normalize(camera - fog[i]);
-		vec3 a = normalize(cross(n, vec3(0, 1, 0))) * 5;
-		vec3 b = cross(a, n);
 
-		glTexCoord2f(0, 0);
-		glVertex(fog[i] - a - b);
-		glTexCoord2f(1, 0);
-		glVertex(fog[i] - a + b);
-		glTexCoord2f(1, 1);
-		glVertex(fog[i] + a + b);
-		glTexCoord2f(0, 1);
-		glVertex(fog[i] + a - b);
+	GLState state;
+	state.enable(GL_BLEND);
+	state.enable(GL_TEXTURE_RECTANGLE_ARB);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	draw_target(graph, pass->src);
+}
+
+}
+
+int bloom_quality = 5;
+bool gpu_particles = false;
+int particle_scale = 2;
+
+void draw_number(vec2 pos, int v, int len, const Color &color)
+{
+	const Sprite *digits = get_sprite("digits.png");
+	double w = DIGIT_WIDTH / digits->width;
+
+	assert(v >= 0);
+
+	pos.x += DIGIT_WIDTH * len;
+	for (int i = 0; i < len; ++i) {
+		pos.x -= DIGIT_WIDTH;
+		double x = (v % 10) * w;
+		sprite_batch.draw_part(digits, pos,
+				       vec2(DIGIT_WIDTH, DIGIT_HEIGHT), color,
+				       x, 0, x + w, 1);
+		v /= 10;
 	}
+}
 
-	glEnd();
-	glDepthMask(GL_TRUE);
+void move_smoke(double full_dt)
+{
+	const double MAX_STEP = 0.02;
+
+	bool gpu = use_gpu_particles();
+	if (gpu) {
+		gpu_smoke.append(&smoke);
+	}
+	while (full_dt > 0) {
+		double dt = std::min(full_dt, MAX_STEP);
+
+		if (gpu) {
+			gpu_smoke.update(dt);
+		} else {
+			update_particles(&smoke, dt);
+		}
+		full_dt -= MAX_STEP;
+	}
+}
+
+void draw_smoke()
+{
+	if (defer_particles(&deferred.smoke))
+		return;
+	render_smoke();
+}
+
+void move_fog(double dt)
+{
+	for (size_t i = 0; i < FOG_COUNT; ++i) {
+		fog[i].x += dt;
+		if (fog[i].x > 50) {
+			fog[i].x -= 100;
+		}
+	}
+}
+
+void draw_fog()
+{
+	if (defer_particles(&deferred.fog))
+		return;
+	render_fog();
 }
 
 void add_smoke(const vec3 &pos, const Color &color, double duration,
@@ -208,41 +479,37 @@ void add_smoke(const vec3 &pos, const Color &color, double duration,
 	}
 
 	for (int i = 0; i < int(count); ++i) {
-		vec3 random = vec3(uniform(), uniform(), uniform()) -
-			      vec3(0.5, 0.5, 0.5);
-		Particle p;
-		p.time = 0.1;
-		p.pos = pos + random;
-		p.vel = random;
-		p.duration = duration;
-		p.color = color;
-		p.size = size;
-		p.color.r += uniform() * 0.2 - 0.1;
-		p.color.g += uniform() * 0.2 - 0.1;
-		p.color.b += uniform() * 0.2 - 0.1;
-		p.color.a += uniform() * 0.4 - 0.2;
-		smoke.push_back(p);
+		float r[7];
+		uniform_fill(r, 7);
+		vec3 random = vec3(r[0], r[1], r[2]) - vec3(0.5, 0.5, 0.5);
+		Color c = color;
+		c.r += r[3] * 0.2 - 0.1;
+		c.g += r[4] * 0.2 - 0.1;
+		c.b += r[5] * 0.2 - 0.1;
+		c.a += r[6] * 0.4 - 0.2;
+		if (!add_particle(&smoke, pos + random, random, c, 0.1,
+				  duration, size)) {
+			break;
+		}
 	}
 }
 
 void clear_smoke()
 {
-	smoke.clear();
+	smoke.count = 0;
+	gpu_smoke.clear();
 }
 
-void begin_bloom()
+void load_effects()
 {
-	static int bloom_w = 0, bloom_h = 0;
-	if (bloom_w != screen->w || bloom_h != screen->h) {
-		create_fbo(&bloom1, screen->w/2, screen->h/2, false);
-		create_fbo(&bloom2, screen->w/2, screen->h/2, false);
-		create_fbo(&bloom_out, screen->w/2, screen->h/2, true);
-		bloom_w = screen->w;
-		bloom_h = screen->h;
+	if (smoke_tex.empty()) {
+		smoke_tex = get_texture("smoke.png");
 	}
+}
 
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, bloom1.fbo);
-	glViewport(0, 0, screen->w/2, screen->h/2);
+void release_effects()
+{
+	smoke_tex = TextureHandle();
 }
 
 const char *simple_vs =
@@ -253,112 +520,122 @@ void main(void)\
 	tc = gl_MultiTexCoord0.xy;\
 }";
 
-const char *bloom1_source =
+/* Box of the 2x2 block under the pixel plus the four diagonal blocks */
+const char *downsample_source =
 "#extension GL_ARB_texture_rectangle : enable\n\
 uniform sampler2DRect tex;\
 varying vec2 tc;\
 void main(void)\
 {\
-	vec4 sum = vec4(0.0);\
-	int i;\
-	float s;\
-	for (i = -9; i < 10; i++) {\
-		s = 1.0 - abs(float(i) * 0.1);\
-		sum = max(sum, texture2DRect(tex, tc + vec2(float(i), 0.0)) * vec4(s));\
-	}\
-	gl_FragColor = sum;\
+	vec4 sum = texture2DRect(tex, tc) * 4.0;\
+	sum += texture2DRect(tex, tc + vec2(-1.0, -1.0));\
+	sum += texture2DRect(tex, tc + vec2(1.0, -1.0));\
+	sum += texture2DRect(tex, tc + vec2(-1.0, 1.0));\
+	sum += texture2DRect(tex, tc + vec2(1.0, 1.0));\
+	gl_FragColor = sum * 0.125;\
 }";
 
-const char *bloom2_source =
+/* 3x3 tent from four bilinear taps */
+const char *upsample_source =
 "#extension GL_ARB_texture_rectangle : enable\n\
 uniform sampler2DRect tex;\
 varying vec2 tc;\
 void main(void)\
 {\
-	vec4 sum = vec4(0.0);\
-	int i;\
-	float s;\
-	for (i = -9; i < 10; i++) {\
-		s = 1.0 - abs(float(i) * 0.1);\
-		sum = max(sum, texture2DRect(tex, tc + vec2(0.0, float(i))) * vec4(s));\
-	}\
-	gl_FragColor = sum;\
+	vec4 sum = texture2DRect(tex, tc + vec2(-0.5, -0.5));\
+	sum += texture2DRect(tex, tc + vec2(0.5, -0.5));\
+	sum += texture2DRect(tex, tc + vec2(-0.5, 0.5));\
+	sum += texture2DRect(tex, tc + vec2(0.5, 0.5));\
+	gl_FragColor = sum * 0.25;\
 }";
 
-/* Will mess matrixes and viewport */
-void end_bloom()
+/*
+ * The scene is drawn once, at full resolution, and copied to the back
+ * buffer. Smoke and fog are drawn at a lower resolution and composited
+ * over the scene first. The scene is then blurred by walking down a chain
+ * of half-sized targets and back up again, adding each level to the one
+ * above, and the result is added on top. Will mess matrixes.
+ */
+void draw_with_bloom(void (*draw_scene)())
 {
-	static GLuint bloom1_program, bloom2_program;
-	if (bloom1_program == 0) {
-		bloom1_program = load_program(simple_vs, bloom1_source);
-		bloom2_program = load_program(simple_vs, bloom2_source);
+	static GLuint downsample_program, upsample_program;
+	if (downsample_program == 0) {
+		downsample_program = load_program(simple_vs, downsample_source);
+		upsample_program = load_program(simple_vs, upsample_source);
 	}
 
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glOrtho(0, 1, 1, 0, -1, 1);
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, bloom2.fbo);
-	glUseProgram(bloom1_program);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, bloom1.texture);
-	glBegin(GL_QUADS);
-	glTexCoord2f(0, 0);
-	glVertex3f(0, 0, 0);
-	glTexCoord2f(0, screen->h/2);
-	glVertex3f(0, 1, 0);
-	glTexCoord2f(screen->w/2, screen->h/2);
-	glVertex3f(1, 1, 0);
-	glTexCoord2f(screen->w/2, 0);
-	glVertex3f(1, 0, 0);
-	glEnd();
-
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, bloom_out.fbo);
-	glUseProgram(bloom2_program);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, bloom2.texture);
-	glBegin(GL_QUADS);
-	glTexCoord2f(0, 0);
-	glVertex3f(0, 0, 0);
-	glTexCoord2f(0, screen->h/2);
-	glVertex3f(0, 1, 0);
-	glTexCoord2f(screen->w/2, screen->h/2);
-	glVertex3f(1, 1, 0);
-	glTexCoord2f(screen->w/2, 0);
-	glVertex3f(1, 0, 0);
-	glEnd();
-
-	glUseProgram(0);
-	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
-	glViewport(0, 0, screen->w, screen->h);
-}
+	FrameGraph graph;
+	int back = graph.back_buffer();
+
+	bool offscreen_particles = particle_scale > 1;
+	SceneFunc scene_func = {draw_scene, offscreen_particles};
+	int scene = graph.create_target("scene", screen->w, screen->h,
+					GL_RGB, false, true);
+	graph.add_pass("scene", scene_pass, &scene_func, scene);
+
+	/* particles go over the scene before it glows */
+	ParticlePass particle;
+	particle.scene = scene;
+	int pass;
+	if (offscreen_particles) {
+		particle.particles = graph.create_target("particles",
+			screen->w / particle_scale,
+			screen->h / particle_scale, GL_RGBA, true, true);
+		pass = graph.add_pass("particles", particle_pass, &particle,
+				      particle.particles);
+		graph.read(pass, scene);
+		pass = graph.add_pass("particle composite",
+				      composite_particles_pass, &particle,
+				      scene);
+		graph.read(pass, particle.particles);
+	}
 
-void draw_bloom()
-{
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
-	glOrtho(0, 1, 1, 0, -1, 1);
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
+	Blit composite = {scene, GL_NEAREST};
+	pass = graph.add_pass("composite", blit_pass, &composite, back);
+	graph.read(pass, scene);
+
+	int levels[MAX_BLOOM_LEVELS];
+	int num_levels = 0;
+	for (int i = 0; i < bloom_quality && i < MAX_BLOOM_LEVELS; ++i) {
+		int w = screen->w >> (i + 1), h = screen->h >> (i + 1);
+		if (w < MIN_BLOOM_SIZE || h < MIN_BLOOM_SIZE)
+			break;
+		levels[num_levels++] = graph.create_target("bloom", w, h,
+							   GL_RGB, true);
+	}
+	if (num_levels == 0) {
+		graph.execute(&render_targets);
+		return;
+	}
 
-	Color c(1, 1, 1, 0.3);
-	glColor(c);
+	/* the 2:1 linear blit averages 2x2 blocks */
+	Blit downsample = {scene, GL_LINEAR};
+	pass = graph.add_pass("bloom downsample", blit_pass, &downsample,
+			      levels[0]);
+	graph.read(pass, scene);
+
+	BloomPass down[MAX_BLOOM_LEVELS], up[MAX_BLOOM_LEVELS];
+	for (int i = 1; i < num_levels; ++i) {
+		down[i].src = levels[i - 1];
+		down[i].program = downsample_program;
+		pass = graph.add_pass("bloom down", downsample_pass, &down[i],
+				      levels[i]);
+		graph.read(pass, levels[i - 1]);
+	}
+	for (int i = num_levels - 2; i >= 0; --i) {
+		up[i].src = levels[i + 1];
+		up[i].program = upsample_program;
+		pass = graph.add_pass("bloom up", upsample_pass, &up[i],
+				      levels[i]);
+		graph.read(pass, levels[i + 1]);
+	}
 
-	GLState state;
-	state.enable(GL_BLEND);
-	state.enable(GL_TEXTURE_RECTANGLE_ARB);
-	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, bloom_out.texture);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+	/* every level was added on top of the first one */
+	BloomPass bloom;
+	bloom.src = levels[0];
+	bloom.intensity = BLOOM_INTENSITY / num_levels;
+	pass = graph.add_pass("bloom", add_bloom_pass, &bloom, back);
+	graph.read(pass, levels[0]);
 
-	glBegin(GL_QUADS);
-	glTexCoord2f(0, 0);
-	glVertex3f(0, 1, 0);
-	glTexCoord2f(screen->w/2, 0);
-	glVertex3f(1, 1, 0);
-	glTexCoord2f(screen->w/2, screen->h/2);
-	glVertex3f(1, 0, 0);
-	glTexCoord2f(0, screen->h/2);
-	glVertex3f(0, 0, 0);
-	glEnd();
+	graph.execute(&render_targets);
 }
-
@@ -6,18 +6,30 @@
 const double DIGIT_WIDTH = 40;
 const double DIGIT_HEIGHT = 64;
 
-void draw_number(vec2 pos, int v, int len);
+/* Number of half-sized levels in the bloom chain, 0 disables the glow */
+extern int bloom_quality;
+
+/* Simulate smoke with transform feedback when OpenGL 3.0 is available */
+extern bool gpu_particles;
+
+/* Smoke and fog are drawn at 1/N of the screen size, 1 draws them inline */
+extern int particle_scale;
+
+/* Adds to sprite_batch, which the caller flushes */
+void draw_number(vec2 pos, int v, int len, const Color &color=Color(1, 1, 1));
 void move_smoke(double dt);
 void draw_smoke();
 void add_smoke(const vec3 &pos, const Color &color, double duration,
 	double count, double size=5);
 void clear_smoke();
+/* Takes the smoke texture, the first draw does it otherwise */
+void load_effects();
+/* Until the next draw, the cache may evict it */
+void release_effects();
 void draw_quad(double x, double y, double w, double h);
 void move_fog(double dt);
 void draw_fog();
-void begin_bloom();
-void end_bloom();
-void draw_bloom();
+void draw_with_bloom(void (*draw_scene)());
 
 #endif
 
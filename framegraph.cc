@@ -0,0 +1,242 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Render target pool and post-processing passes
+ */
+#include "framegraph.h"
+#include "utils.h"
+#include <SDL.h>
+
+extern SDL_Surface *screen;
+
+namespace {
+
+/* Frames an unused target is kept around */
+const int TARGET_LIFETIME = 2;
+
+}
+
+RenderTargetPool::RenderTargetPool() :
+	m_frame(0)
+{
+}
+
+RenderTargetPool::~RenderTargetPool()
+{
+	FOR_EACH(std::list<RenderTarget>, target, m_targets) {
+		delete_fbo(&target->fbo);
+	}
+}
+
+RenderTarget *RenderTargetPool::acquire(int width, int height, GLenum format,
+					bool bilinear, bool depth)
+{
+	FOR_EACH(std::list<RenderTarget>, target, m_targets) {
+		if (!target->in_use && target->width == width &&
+		    target->height == height && target->format == format &&
+		    target->bilinear == bilinear && target->depth == depth) {
+			target->in_use = true;
+			target->last_frame = m_frame;
+			return &*target;
+		}
+	}
+
+	RenderTarget target;
+	create_fbo(&target.fbo, width, height, bilinear, format, depth);
+	target.width = width;
+	target.height = height;
+	target.format = format;
+	target.bilinear = bilinear;
+	target.depth = depth;
+	target.in_use = true;
+	target.last_frame = m_frame;
+	m_targets.push_back(target);
+	return &m_targets.back();
+}
+
+void RenderTargetPool::release(RenderTarget *target)
+{
+	assert(target->in_use);
+	target->in_use = false;
+}
+
+void RenderTargetPool::end_frame()
+{
+	FOR_EACH_SAFE(std::list<RenderTarget>, target, m_targets) {
+		if (!target->in_use &&
+		    m_frame - target->last_frame > TARGET_LIFETIME) {
+			delete_fbo(&target->fbo);
+			m_targets.erase(target);
+		}
+	}
+	m_frame++;
+}
+
+FrameGraph::FrameGraph()
+{
+	Resource back;
+	back.name = "back buffer";
+	back.width = screen->w;
+	back.height = screen->h;
+	back.format = GL_RGB;
+	back.bilinear = false;
+	back.depth = true;
+	back.needed = true;
+	back.target = NULL;
+	m_resources.push_back(back);
+}
+
+int FrameGraph::create_target(const char *name, int width, int height,
+			      GLenum format, bool bilinear, bool depth)
+{
+	Resource res;
+	res.name = name;
+	res.width = width;
+	res.height = height;
+	res.format = format;
+	res.bilinear = bilinear;
+	res.depth = depth;
+	res.needed = false;
+	res.target = NULL;
+	m_resources.push_back(res);
+	return m_resources.size() - 1;
+}
+
+int FrameGraph::add_pass(const char *name, Func func, void *data, int output)
+{
+	Pass pass;
+	pass.name = name;
+	pass.func = func;
+	pass.data = data;
+	pass.output = output;
+	pass.culled = false;
+	m_passes.push_back(pass);
+	return m_passes.size() - 1;
+}
+
+void FrameGraph::read(int pass, int resource)
+{
+	m_passes[pass].inputs.push_back(resource);
+}
+
+GLuint FrameGraph::fbo(int resource) const
+{
+	const Resource *res = &m_resources[resource];
+	if (res->target == NULL) {
+		return 0;
+	}
+	return res->target->fbo.fbo;
+}
+
+GLuint FrameGraph::texture(int resource) const
+{
+	const Resource *res = &m_resources[resource];
+	assert(res->target != NULL);
+	return res->target->fbo.texture;
+}
+
+/* Walk backwards from the back buffer, marking what is actually used */
+void FrameGraph::cull()
+{
+	for (int i = m_passes.size() - 1; i >= 0; --i) {
+		Pass *pass = &m_passes[i];
+		pass->culled = !m_resources[pass->output].needed;
+		if (pass->culled) {
+			debug("culled pass %s\n", pass->name);
+			continue;
+		}
+		FOR_EACH_CONST(std::vector<int>, input, pass->inputs) {
+			m_resources[*input].needed = true;
+		}
+	}
+}
+
+void FrameGraph::use(int resource, int pass)
+{
+	Resource *res = &m_resources[resource];
+	if (res->first_use < 0) {
+		res->first_use = pass;
+	}
+	res->last_use = pass;
+}
+
+void FrameGraph::execute(RenderTargetPool *pool)
+{
+	cull();
+
+	FOR_EACH(std::vector<Resource>, res, m_resources) {
+		res->first_use = -1;
+		res->last_use = -1;
+	}
+	for (size_t i = 0; i < m_passes.size(); ++i) {
+		const Pass *pass = &m_passes[i];
+		if (pass->culled)
+			continue;
+		use(pass->output, i);
+		FOR_EACH_CONST(std::vector<int>, input, pass->inputs) {
+			use(*input, i);
+		}
+	}
+
+	for (size_t i = 0; i < m_passes.size(); ++i) {
+		const Pass *pass = &m_passes[i];
+		if (pass->culled)
+			continue;
+
+		/* resource 0 is the back buffer, which is not pooled */
+		for (size_t j = 1; j < m_resources.size(); ++j) {
+			Resource *res = &m_resources[j];
+			if (res->first_use == int(i)) {
+				res->target = pool->acquire(res->width,
+					res->height, res->format,
+					res->bilinear, res->depth);
+			}
+		}
+
+		const Resource *out = &m_resources[pass->output];
+		glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo(pass->output));
+		glViewport(0, 0, out->width, out->height);
+
+		glMatrixMode(GL_PROJECTION);
+		glLoadIdentity();
+		glOrtho(0, 1, 1, 0, -1, 1);
+		glMatrixMode(GL_MODELVIEW);
+		glLoadIdentity();
+
+		pass->func(this, pass->data);
+
+		for (size_t j = 1; j < m_resources.size(); ++j) {
+			Resource *res = &m_resources[j];
+			if (res->last_use == int(i)) {
+				pool->release(res->target);
+			}
+		}
+	}
+
+	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+	glViewport(0, 0, screen->w, screen->h);
+	pool->end_frame();
+}
+
+/* Covers the target of the pass, texture coordinates in resource pixels */
+void draw_target(const FrameGraph *graph, int resource)
+{
+	int w = graph->width(resource), h = graph->height(resource);
+	glBindTexture(GL_TEXTURE_RECTANGLE_ARB, graph->texture(resource));
+	glBegin(GL_QUADS);
+	glTexCoord2f(0, h);
+	glVertex3f(0, 0, 0);
+	glTexCoord2f(0, 0);
+	glVertex3f(0, 1, 0);
+	glTexCoord2f(w, 0);
+	glVertex3f(1, 1, 0);
+	glTexCoord2f(w, h);
+	glVertex3f(1, 0, 0);
+	glEnd();
+}
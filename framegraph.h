@@ -0,0 +1,92 @@
+#ifndef __framegraph_h
+#define __framegraph_h
+
+#include "gl.h"
+
+struct RenderTarget {
+	FBO fbo;
+	int width, height;
+	GLenum format;
+	bool bilinear, depth;
+	bool in_use;
+	int last_frame;
+};
+
+/*
+ * Render targets are handed out by size and format. Targets that have not
+ * been used for a couple of frames (after a resize, say) are freed.
+ */
+class RenderTargetPool {
+public:
+	RenderTargetPool();
+	~RenderTargetPool();
+
+	RenderTarget *acquire(int width, int height, GLenum format,
+			      bool bilinear, bool depth);
+	void release(RenderTarget *target);
+	void end_frame();
+
+private:
+	std::list<RenderTarget> m_targets;
+	int m_frame;
+
+	DISABLE_COPY_AND_ASSIGN(RenderTargetPool);
+};
+
+/*
+ * Passes declare the targets they read and the one they draw to. Passes
+ * whose output nobody needs are dropped, and transient targets are taken
+ * from the pool just before their first use and given back after their last
+ * one, so later passes can reuse them within the same frame.
+ */
+class FrameGraph {
+public:
+	typedef void (*Func)(const FrameGraph *graph, void *data);
+
+	FrameGraph();
+
+	int back_buffer() const { return 0; }
+	int create_target(const char *name, int width, int height,
+			  GLenum format, bool bilinear, bool depth=false);
+	int add_pass(const char *name, Func func, void *data, int output);
+	void read(int pass, int resource);
+	void execute(RenderTargetPool *pool);
+
+	/* For use in passes */
+	GLuint fbo(int resource) const;
+	GLuint texture(int resource) const;
+	int width(int resource) const { return m_resources[resource].width; }
+	int height(int resource) const { return m_resources[resource].height; }
+
+private:
+	struct Resource {
+		const char *name;
+		int width, height;
+		GLenum format;
+		bool bilinear, depth;
+		bool needed;
+		int first_use, last_use;
+		RenderTarget *target;
+	};
+
+	struct Pass {
+		const char *name;
+		Func func;
+		void *data;
+		std::vector<int> inputs;
+		int output;
+		bool culled;
+	};
+
+	std::vector<Resource> m_resources;
+	std::vector<Pass> m_passes;
+
+	void cull();
+	void use(int resource, int pass);
+
+	DISABLE_COPY_AND_ASSIGN(FrameGraph);
+};
+
+void draw_target(const FrameGraph *graph, int resource);
+
+#endif
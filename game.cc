@@ -17,6 +17,9 @@
 #include "sound.h"
 #include "zombie.h"
 #include "effects.h"
+#include "sprites.h"
+#include "loader.h"
+#include "resources.h"
 #include <stdexcept>
 #include <SDL.h>
 
@@ -35,6 +38,9 @@ bool quit_game;
 
 namespace {
 
+/* Average frame time is logged this often with -debug */
+const Uint32 FRAME_REPORT_TICKS = 5000;
+
 enum {
 	MOVE_LEFT_HAND,
 	MOVE_RIGHT_HAND,
@@ -93,7 +99,10 @@ const Section *section = NULL;
 bool moving;
 bool rotating;
 bool rotating_camera;
-Model stagemodel;
+/* held from prefetch_level() until game() returns */
+ModelHandle stagemodel;
+TextureHandle noisetex;
+SoundHandle notehits[2], wooa, voih[2];
 bool standing;
 bool jumping;
 double interval;
@@ -274,19 +283,39 @@ Joint *get_selected_joint()
 	return nearest;
 }
 
-void got_move(int move, int mult = 1)
+void load_stage(const Stage *s)
 {
-	static Sound notehits[2], wooa;
-	if (notehits[0].data.empty()) {
-		load_sound(&notehits[0], "notehit1.ogg");
-		load_sound(&notehits[1], "notehit2.ogg");
-		load_sound(&wooa, "wooa.ogg");
-	}
+	/* the previous one stays cached while the budget allows */
+	stagemodel = get_model(s->model, s->scale);
+	noisetex = get_texture("noise.png");
+}
+
+void load_sounds()
+{
+	if (!wooa.empty())
+		return;
+	notehits[0] = get_sound("notehit1.ogg");
+	notehits[1] = get_sound("notehit2.ogg");
+	wooa = get_sound("wooa.ogg");
+	voih[0] = get_sound("voih1.ogg");
+	voih[1] = get_sound("voih2.ogg");
+}
+
+void wait_sounds()
+{
+	notehits[0].wait();
+	notehits[1].wait();
+	wooa.wait();
+	voih[0].wait();
+	voih[1].wait();
+}
 
+void got_move(int move, int mult = 1)
+{
 	debug("got move %s\n", moves[move].picname);
 
 	if (move == MOVE_FLIP) {
-		play_sound(&wooa);
+		play_sound(wooa.get());
 	}
 
 	if (level == NULL) {
@@ -306,7 +335,7 @@ void got_move(int move, int mult = 1)
 			msg_visible = 1.0;
 			mult++;
 		}
-		play_sound(&notehits[rand() & 1]);
+		play_sound(notehits[random_u64() & 1].get());
 		Hit hit;
 		hit.move = move;
 		hit.t = get_music_time();
@@ -325,12 +354,6 @@ void got_move(int move, int mult = 1)
 
 void simulate()
 {
-	static Sound voih[2];
-	if (voih[0].data.empty()) {
-		load_sound(&voih[0], "voih1.ogg");
-		load_sound(&voih[1], "voih2.ogg");
-	}
-
 	if (level != NULL) {
 	const Section *next = section + 1;
 	if (get_music_time() >= next->t) {
@@ -555,7 +578,7 @@ void simulate()
 		for (size_t i = 0; i < stage->num_blocks; ++i) {
 			double hit = apply_block(&player, &stage->blocks[i], dt);
 			if (uniform() < dt*hit*0.01) {
-				play_sound(&voih[rand() & 1]);
+				play_sound(voih[random_u64() & 1].get());
 			}
 		}
 
@@ -571,17 +594,11 @@ void simulate()
 	}
 }
 
+/* Sprites go to sprite_batch, the texts are drawn after it is flushed */
 void draw_scroller()
 {
-	static GLuint cursor = INVALID_TEXTURE, bar;
-	static GLuint move_pictures[MAX_MOVE];
-	if (cursor == INVALID_TEXTURE) {
-		cursor = load_png("cursor.png");
-		bar = load_png("bar.png");
-		for (int i = 0; i < MAX_MOVE; ++i) {
-			move_pictures[i] = load_png(moves[i].picname);
-		}
-	}
+	const Sprite *cursor = get_sprite("cursor.png");
+	const Sprite *bar = get_sprite("bar.png");
 
 	/* Sections */
 	for (int i = 0; level->sections[i].pattern != &pat_end; ++i) {
@@ -592,91 +609,58 @@ void draw_scroller()
 		if (x > screen->w/2)
 			break;
 
-		glPushMatrix();
-		glTranslatef(x + screen->w/2, screen->h - 80, 0);
-
-		{
-			GLState state;
-			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-			state.enable(GL_BLEND);
-			state.enable(GL_TEXTURE_2D);
-
-			Color c = sec->pattern->color;
-			c.a = 1 - (get_music_time() - beat_t);
-			glColor(c);
-
-			double len = next->t - sec->t;
-
-			glBindTexture(GL_TEXTURE_2D, bar);
-			glBegin(GL_QUADS);
-			glTexCoord2f(0, 0);
-			glVertex2f(0, 0);
-			glTexCoord2f(0, 1);
-			glVertex2f(0, 50);
-			glTexCoord2f(len / (60 / sec->bpm), 1);
-			glVertex2f(len * 100, 50);
-			glTexCoord2f(len / (60 / sec->bpm), 0);
-			glVertex2f(len * 100, 0);
-			glEnd();
+		Color c = sec->pattern->color;
+		c.a = 1 - (get_music_time() - beat_t);
+
+		/* the bar picture repeats once per beat */
+		double width = (next->t - sec->t) * 100;
+		double beat = 100 * 60 / sec->bpm;
+		vec2 pos(x + screen->w/2, screen->h - 80);
+		for (double start = 0; start < width; start += beat) {
+			double w = std::min(beat, width - start);
+			sprite_batch.draw_part(bar, pos + vec2(start, 0),
+					       vec2(w, 50), c, 0, 0, w / beat, 1);
 		}
-		glColor(black);
-		vera.draw_text(vec2(6, 31), sec->pattern->descr);
-		glColor(white);
-		vera.draw_text(vec2(5, 30), sec->pattern->descr);
-
-		glPopMatrix();
 	}
 
 	/* Hits */
-	{
-		GLState state;
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		state.enable(GL_BLEND);
-		state.enable(GL_TEXTURE_2D);
-
-		FOR_EACH(std::list<Hit>, hit, hits) {
-			double x = (hit->t - get_music_time()) * 100;
-
-			glColor(white);
-			vec2 pos(x + screen->w/2 - 32, screen->h - 64);
-			glBindTexture(GL_TEXTURE_2D, move_pictures[hit->move]);
-			draw_quad(pos, vec2(64, 64));
-		}
+	FOR_EACH(std::list<Hit>, hit, hits) {
+		double x = (hit->t - get_music_time()) * 100;
+		vec2 pos(x + screen->w/2 - 32, screen->h - 64);
+		sprite_batch.draw(get_sprite(moves[hit->move].picname), pos,
+				  vec2(64, 64), white);
 	}
 
 	/* Cursor */
-	{
-		GLState state;
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		state.enable(GL_BLEND);
-		state.enable(GL_TEXTURE_2D);
-
-		Color color(1, 1, 1, 1 - (get_music_time() - beat_t));
-		glColor(color);
-
-		vec2 pos(screen->w/2 - 64, screen->h - 128);
-		glBindTexture(GL_TEXTURE_2D, cursor);
-		draw_quad(pos, vec2(128, 128));
-	}
+	Color color(1, 1, 1, 1 - (get_music_time() - beat_t));
+	sprite_batch.draw(cursor, vec2(screen->w/2 - 64, screen->h - 128),
+			  vec2(128, 128), color);
 
 	const Color inactive(1, 1, 1, 0.3);
 
-	GLState state;
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	state.enable(GL_BLEND);
-	state.enable(GL_TEXTURE_2D);
-
 	const Pattern *pattern = section->pattern;
 	for (int i = 0; pattern->pattern[i] >= 0; ++i) {
-		if (pattern_pos == i) {
-			glColor(white);
-		} else {
-			glColor(inactive);
-		}
 		vec2 pos(screen->w - 150, 20 + i * 130);
-		glBindTexture(GL_TEXTURE_2D,
-			      move_pictures[pattern->pattern[i]]);
-		draw_quad(pos, vec2(128, 128));
+		sprite_batch.draw(get_sprite(moves[pattern->pattern[i]].picname),
+				  pos, vec2(128, 128),
+				  pattern_pos == i ? white : inactive);
+	}
+}
+
+void draw_scroller_text()
+{
+	for (int i = 0; level->sections[i].pattern != &pat_end; ++i) {
+		const Section *sec = &level->sections[i];
+
+		double x = (sec->t - get_music_time()) * 100;
+		if (x > screen->w/2)
+			break;
+
+		vec2 pos(x + screen->w/2, screen->h - 80);
+		glColor(black);
+		vera.draw_text(pos + vec2(6, 31), sec->pattern->descr);
+		glColor(white);
+		vera.draw_text(pos + vec2(5, 30), sec->pattern->descr);
 	}
 }
 
@@ -722,7 +706,7 @@ void draw_scene()
 		state.enable(GL_FOG);
 
 		draw_zombies(player.joints[ASS].pos);
-		stagemodel.draw(true);
+		stagemodel->draw(noisetex.get());
 
 		state.enable(GL_NORMALIZE);
 		calc_posture(&player);
@@ -746,26 +730,22 @@ void draw_scene()
 
 void draw()
 {
-	static GLuint msgpics[MAX_MESSAGE];
-	static GLuint camera_tex = INVALID_TEXTURE, standup;
-	if (camera_tex == INVALID_TEXTURE) {
-		msgpics[GOOD] = load_png("good.png");
-		msgpics[TRYAGAIN] = load_png("tryagain.png");
-		msgpics[EXCELLENT] = load_png("excellent.png");
-		camera_tex = load_png("camera.png");
-		standup = load_png("standup.png");
-	}
-
-	if (GLEW_VERSION_3_0) {
-		begin_bloom();
-		draw_scene();
-		end_bloom();
+	static const Sprite *msgpics[MAX_MESSAGE];
+	if (msgpics[GOOD] == NULL) {
+		msgpics[GOOD] = get_sprite("good.png");
+		msgpics[TRYAGAIN] = get_sprite("tryagain.png");
+		msgpics[EXCELLENT] = get_sprite("excellent.png");
 	}
 
-	draw_scene();
+	cull_stats.groups_drawn = 0;
+	cull_stats.groups_culled = 0;
+	cull_stats.zombies_drawn = 0;
+	cull_stats.zombies_culled = 0;
 
 	if (GLEW_VERSION_3_0) {
-		draw_bloom();
+		draw_with_bloom(draw_scene);
+	} else {
+		draw_scene();
 	}
 
 	glMatrixMode(GL_PROJECTION);
@@ -774,41 +754,30 @@ void draw()
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
-	glColor(white);
 	draw_number(vec2(10, 10), score, 8);
 
 	if (level != NULL) {
 		draw_scroller();
 	}
 
-	{
-		GLState state;
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		state.enable(GL_BLEND);
-		state.enable(GL_TEXTURE_2D);
-
-		glColor(white);
-		glBindTexture(GL_TEXTURE_2D, camera_tex);
-		draw_quad(vec2(screen->w - 150 - 64, screen->h - 150 - 64),
-			  vec2(128, 128));
-
-		if (!standing) {
-			glBindTexture(GL_TEXTURE_2D, standup);
-			draw_quad(vec2(10, screen->h - 150), vec2(128, 64));
-		}
+	sprite_batch.draw(get_sprite("camera.png"),
+			  vec2(screen->w - 150 - 64, screen->h - 150 - 64),
+			  vec2(128, 128), white);
+	if (!standing) {
+		sprite_batch.draw(get_sprite("standup.png"),
+				  vec2(10, screen->h - 150), vec2(128, 64), white);
 	}
 
 	if (msg_visible > 0) {
-		GLState state;
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		state.enable(GL_BLEND);
-		state.enable(GL_TEXTURE_2D);
-
 		Color color(1, 1, 1, msg_visible);
-		glColor(color);
-		vec2 pos(screen->w/2 - 128, 10);
-		glBindTexture(GL_TEXTURE_2D, msgpics[msg]);
-		draw_quad(pos, vec2(256, 128));
+		sprite_batch.draw(msgpics[msg], vec2(screen->w/2 - 128, 10),
+				  vec2(256, 128), color);
+	}
+
+	sprite_batch.flush();
+
+	if (level != NULL) {
+		draw_scroller_text();
 	}
 
 	if (rotating) {
@@ -816,11 +785,75 @@ void draw()
 		int degrees = fabs(rotation) * 360 / (M_PI * 2);
 		vera.draw_text(vec2(screen->w/2 - 64, 100), strf("%d\xB0", degrees));
 	}
+
+	if (debug_enabled) {
+		static Uint32 last_ticks = 0, report_ticks = 0;
+		static int report_frames = 0;
+		static double frame_time;
+		Uint32 ticks = SDL_GetTicks();
+		if (last_ticks == 0) {
+			last_ticks = ticks;
+			report_ticks = ticks;
+		}
+		frame_time = frame_time * 0.9 + (ticks - last_ticks) * 0.1;
+		last_ticks = ticks;
+
+		/* for comparing -particleres and resolutions */
+		if (report_frames > 0 &&
+		    ticks - report_ticks >= FRAME_REPORT_TICKS) {
+			debug("%dx%d, particleres %d: %.2f ms per frame "
+			      "over %d frames\n", screen->w, screen->h,
+			      particle_scale,
+			      double(ticks - report_ticks) / report_frames,
+			      report_frames);
+			report_ticks = ticks;
+			report_frames = 0;
+		}
+		report_frames++;
+
+		glColor(white);
+		vera.draw_text(vec2(10, 100),
+			strf("drawn/culled groups %d/%d, zombies %d/%d",
+			     cull_stats.groups_drawn, cull_stats.groups_culled,
+			     cull_stats.zombies_drawn,
+			     cull_stats.zombies_culled));
+		vera.draw_text(vec2(10, 130), strf("frame %.1f ms",
+			       frame_time));
+		vera.draw_text(vec2(10, 160),
+			       strf("textures %zd KB, models %zd KB, "
+				    "sounds %zd KB",
+				    resident_bytes(RESOURCE_TEXTURE) >> 10,
+				    resident_bytes(RESOURCE_MODEL) >> 10,
+				    resident_bytes(RESOURCE_SOUND) >> 10));
+	}
 }
 
 }
 
-bool game()
+void prefetch_level(const Level *next)
+{
+	load_stage(next->stage);
+	load_sounds();
+	load_zombies();
+	load_effects();
+	prepare_music(next->music);
+}
+
+namespace {
+
+/* The cache may evict them until the next level takes them again */
+void release_level()
+{
+	stagemodel = ModelHandle();
+	noisetex = TextureHandle();
+	notehits[0] = notehits[1] = SoundHandle();
+	wooa = SoundHandle();
+	voih[0] = voih[1] = SoundHandle();
+	release_zombies();
+	release_effects();
+}
+
+bool play_level()
 {
 	quit_game = false;
 	clear_smoke();
@@ -859,12 +892,19 @@ bool game()
 			zombies.push_back(zombie);
 		}
 	}
-	stagemodel.load(stage->model, stage->scale);
+	load_stage(stage);
+	load_sounds();
+	load_zombies();
 	if (player.joints.empty()) {
 		load_skeleton(&player, "human.obj", stage->origo);
 	} else {
 		reset_skeleton(&player, stage->origo);
 	}
+	/* usually done during the intermission already */
+	stagemodel.wait();
+	wait_sounds();
+	wait_zombies();
+	trim_resources();
 	if (level != NULL) {
 		section = level->sections;
 		play_music(level->music);
@@ -931,12 +971,22 @@ bool game()
 		draw();
 
 		SDL_GL_SwapBuffers();
+		finish_loads();
 		SDL_Delay(5);
 		check_gl_errors();
 	}
 	return level == NULL || (section->pattern == &pat_end);
 }
 
+}
+
+bool game()
+{
+	bool won = play_level();
+	release_level();
+	return won;
+}
+
 const Level levels[] = {
 	{"1/4: Graveyard", "You lost your job due to recent layoffs.\n"
 	"To blow off the steam, you are dancing on the grave of your old boss.",
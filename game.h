@@ -44,6 +44,8 @@ extern int msg;
 extern double msg_visible;
 extern bool quit_game;
 
+/* Starts loading what the level needs, the rest of game() is quick */
+void prefetch_level(const Level *next);
 bool game();
 
 #endif
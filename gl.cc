@@ -11,23 +11,35 @@
  */
 #include "gl.h"
 #include "utils.h"
+#include "simplify.h"
+#include "vertexcache.h"
+#include "archive.h"
+#include "loader.h"
 #include <SDL.h>
 #include <png.h>
 #include <ft2build.h>
 #include <freetype/freetype.h>
 #include <freetype/ftglyph.h>
 #include <stdexcept>
+#include <algorithm>
 #include <vector>
-#include <fstream>
-#include <sstream>
 
 extern SDL_Surface *screen;
 
+CullStats cull_stats;
+bool quantize_models = true;
+bool compress_textures = true;
+
 namespace {
 
 const Color white(1, 1, 1);
 
-const int PAD = 2;
+/* Distance fields are made from glyphs rendered this many times larger */
+const int SDF_SIZE = 24;
+const int SDF_UPSCALE = 4;
+/* Distance in atlas pixels that maps to the full alpha range */
+const int SDF_SPREAD = 4;
+const float SDF_INF = 1e20;
 
 int round_power2(int val)
 {
@@ -37,36 +49,296 @@ int round_power2(int val)
 	return i;
 }
 
-void load_materials(group_map_t &groups, const char *fname)
+/* Triangles per group below which no further LODs are made */
+const size_t MIN_LOD_FACES = 64;
+
+/* Projected diameter in pixels below which LOD 1 is used, halves per level */
+const double LOD_PIXELS = 256;
+
+struct ModelVertex {
+	float pos[3], normal[3], texcoord[2];
+	GLubyte color[4];
+};
+
+struct VertexKey {
+	size_t vert, norm;
+	int group;
+
+	bool operator < (const VertexKey &o) const
+	{
+		if (vert != o.vert)
+			return vert < o.vert;
+		if (norm != o.norm)
+			return norm < o.norm;
+		return group < o.group;
+	}
+};
+
+/*
+ * 16 bytes instead of 36. The positions are relative to the model bounds
+ * and decoded with the modelview matrix, the texture coordinates are
+ * generated from them.
+ */
+struct PackedVertex {
+	GLshort pos[4];
+	GLbyte normal[4];
+	GLubyte color[4];
+};
+
+typedef std::map<VertexKey, unsigned> vertex_map_t;
+
+const unsigned NO_INDEX = unsigned(-1);
+
+/* FIFO size used for the debug statistics */
+const size_t STATS_CACHE_SIZE = 16;
+
+GLubyte color_byte(float c)
 {
-	std::ifstream f(fname);
-	if (!f) {
-		throw std::runtime_error(strf("Can not open %s", fname));
+	return lrint(std::max(std::min(c, 1.0f), 0.0f) * 255);
+}
+
+/* Appends the faces as a new range, sharing the vertices already added */
+void add_faces(Model::ModelLOD *lod, std::vector<ModelVertex> *vertices,
+	       std::vector<unsigned> *indices, vertex_map_t *vertex_map,
+	       const Mesh &mesh, const std::vector<Face> &faces,
+	       const Color &color, int group)
+{
+	std::vector<unsigned> buf;
+	FOR_EACH_CONST(std::vector<Face>, face, faces) {
+		for (int i = 0; i < 3; ++i) {
+			VertexKey key = {face->vert[i], face->norm[i], group};
+			vertex_map_t::const_iterator found =
+				vertex_map->find(key);
+			if (found != vertex_map->end()) {
+				buf.push_back(found->second);
+				continue;
+			}
+			vec3 p = mesh.vertices[face->vert[i]];
+			vec3 n = mesh.normals[face->norm[i]];
+			ModelVertex gv;
+			gv.pos[0] = p.x;
+			gv.pos[1] = p.y;
+			gv.pos[2] = p.z;
+			gv.normal[0] = n.x;
+			gv.normal[1] = n.y;
+			gv.normal[2] = n.z;
+			gv.texcoord[0] = (p.x + p.y) * 0.3;
+			gv.texcoord[1] = (p.z + p.y) * 0.3;
+			gv.color[0] = color_byte(color.r);
+			gv.color[1] = color_byte(color.g);
+			gv.color[2] = color_byte(color.b);
+			gv.color[3] = color_byte(color.a);
+			unsigned index = vertices->size();
+			vertices->push_back(gv);
+			ins(*vertex_map, key, index);
+			buf.push_back(index);
+		}
 	}
-	std::string line;
-	Group *group = NULL;
-	while (std::getline(f, line)) {
-		std::istringstream parser(line);
-		std::string token;
-		parser >> token;
-		if (!parser || token[0] == '#')
-			continue;
 
-		if (token == "newmtl") {
-			std::string name;
-			parser >> name;
-			std::pair<group_map_t::iterator, bool> res =
-				groups.insert(std::make_pair(name, Group()));
-			group = &res.first->second;
-		} else if (token == "Kd") {
-			parser >> group->diffuse.r >> group->diffuse.g
-				>> group->diffuse.b;
-			if (!parser) {
-				throw std::runtime_error("Corrupted material file");
+	double before = 0;
+	if (debug_enabled) {
+		before = cache_miss_ratio(buf, STATS_CACHE_SIZE);
+	}
+	optimize_vertex_cache(&buf, vertices->size());
+	debug("vertex cache misses per triangle %.2f -> %.2f\n", before,
+	      cache_miss_ratio(buf, STATS_CACHE_SIZE));
+
+	lod->first = indices->size();
+	lod->count = buf.size();
+	indices->insert(indices->end(), buf.begin(), buf.end());
+}
+
+/* Simplified face lists of one group, LOD 1 and up */
+typedef std::vector<std::vector<Face> > lod_list_t;
+
+const char LOD_CACHE_MAGIC[8] = {'S', 'E', 'K', 'O', 'L', 'O', 'D', '1'};
+
+/* Each LOD halves the triangle count of the previous one */
+void simplify_lods(lod_list_t *lods, const Mesh &mesh,
+		   const std::vector<Face> &faces)
+{
+	std::vector<Face> current = faces;
+	for (int i = 1; i < Model::MAX_LOD; ++i) {
+		size_t target = current.size() / 2;
+		if (target < MIN_LOD_FACES)
+			break;
+		size_t prev = current.size();
+		simplify_faces(&current, mesh.vertices, target);
+		if (current.size() > prev * 3 / 4)
+			break;
+		lods->push_back(current);
+	}
+}
+
+/* Keyed by the loaded mesh, so the archive and loose files share it */
+std::string lod_cache_name(const Mesh &mesh)
+{
+	uint64_t hash = fnv1a(LOD_CACHE_MAGIC, sizeof LOD_CACHE_MAGIC);
+	hash = fnv1a(&MIN_LOD_FACES, sizeof MIN_LOD_FACES, hash);
+	if (!mesh.vertices.empty()) {
+		hash = fnv1a(&mesh.vertices[0],
+			     sizeof(vec3) * mesh.vertices.size(), hash);
+	}
+	FOR_EACH_CONST(group_map_t, iter, mesh.groups) {
+		const std::vector<Face> &faces = iter->second.faces;
+		hash = fnv1a(iter->first.data(), iter->first.size() + 1,
+			     hash);
+		if (!faces.empty()) {
+			hash = fnv1a(&faces[0], sizeof(Face) * faces.size(),
+				     hash);
+		}
+	}
+	return cache_file(strf("lod-%016llx", (unsigned long long) hash));
+}
+
+void write_lod_cache(const char *fname, const std::vector<lod_list_t> &lods)
+{
+	std::string out(LOD_CACHE_MAGIC, sizeof LOD_CACHE_MAGIC);
+	FOR_EACH_CONST(std::vector<lod_list_t>, group, lods) {
+		uint32_t num_lods = group->size();
+		out.append((const char *) &num_lods, sizeof num_lods);
+		FOR_EACH_CONST(lod_list_t, lod, *group) {
+			uint32_t num_faces = lod->size();
+			out.append((const char *) &num_faces, sizeof num_faces);
+			FOR_EACH_CONST(std::vector<Face>, face, *lod) {
+				uint32_t v[6];
+				for (int i = 0; i < 3; ++i) {
+					v[i] = face->vert[i];
+					v[3 + i] = face->norm[i];
+				}
+				out.append((const char *) v, sizeof v);
 			}
-			group->diffuse.a = 1;
 		}
 	}
+	if (!write_file(fname, out)) {
+		warning("Can not write: %s\n", fname);
+	}
+}
+
+/* False if it is damaged or does not fit the mesh */
+bool read_lod_cache(std::vector<lod_list_t> *lods, const std::string &data,
+		    const Mesh &mesh, size_t num_groups)
+{
+	if (data.size() < sizeof LOD_CACHE_MAGIC ||
+	    memcmp(data.data(), LOD_CACHE_MAGIC, sizeof LOD_CACHE_MAGIC))
+		return false;
+	size_t pos = sizeof LOD_CACHE_MAGIC;
+	lods->assign(num_groups, lod_list_t());
+	for (size_t g = 0; g < num_groups; ++g) {
+		uint32_t num_lods;
+		if (data.size() - pos < sizeof num_lods)
+			return false;
+		memcpy(&num_lods, &data[pos], sizeof num_lods);
+		pos += sizeof num_lods;
+		if (num_lods >= unsigned(Model::MAX_LOD))
+			return false;
+		for (uint32_t l = 0; l < num_lods; ++l) {
+			uint32_t num_faces;
+			if (data.size() - pos < sizeof num_faces)
+				return false;
+			memcpy(&num_faces, &data[pos], sizeof num_faces);
+			pos += sizeof num_faces;
+			if ((data.size() - pos) / (6 * sizeof(uint32_t)) <
+			    num_faces)
+				return false;
+			(*lods)[g].push_back(std::vector<Face>(num_faces));
+			std::vector<Face> &faces = (*lods)[g].back();
+			for (uint32_t i = 0; i < num_faces; ++i) {
+				uint32_t v[6];
+				memcpy(v, &data[pos], sizeof v);
+				pos += sizeof v;
+				for (int j = 0; j < 3; ++j) {
+					if (v[j] >= mesh.vertices.size() ||
+					    v[3 + j] >= mesh.normals.size())
+						return false;
+					faces[i].vert[j] = v[j];
+					faces[i].norm[j] = v[3 + j];
+				}
+			}
+		}
+	}
+	return pos == data.size();
+}
+
+GLshort quantize_coord(float v, float offset, float scale)
+{
+	return lrint(std::max(std::min((v - offset) / scale, 32767.0f),
+			      -32767.0f));
+}
+
+GLbyte quantize_normal(float n)
+{
+	return lrint(std::max(std::min(n, 1.0f), -1.0f) * 127);
+}
+
+void pack_vertices(std::vector<PackedVertex> *out,
+		   const std::vector<ModelVertex> &vertices,
+		   const vec3 &offset, double scale)
+{
+	out->resize(vertices.size());
+	for (size_t i = 0; i < vertices.size(); ++i) {
+		const ModelVertex *v = &vertices[i];
+		PackedVertex *p = &(*out)[i];
+		p->pos[0] = quantize_coord(v->pos[0], offset.x, scale);
+		p->pos[1] = quantize_coord(v->pos[1], offset.y, scale);
+		p->pos[2] = quantize_coord(v->pos[2], offset.z, scale);
+		p->pos[3] = 0;
+		for (int j = 0; j < 3; ++j) {
+			p->normal[j] = quantize_normal(v->normal[j]);
+		}
+		p->normal[3] = 0;
+		memcpy(p->color, v->color, sizeof p->color);
+	}
+}
+
+/* Renumbers the vertices in the order they are first used */
+void reorder_vertices(std::vector<ModelVertex> *vertices,
+		      std::vector<unsigned> *indices)
+{
+	std::vector<unsigned> remap(vertices->size(), NO_INDEX);
+	std::vector<ModelVertex> out;
+	out.reserve(vertices->size());
+	FOR_EACH(std::vector<unsigned>, i, *indices) {
+		if (remap[*i] == NO_INDEX) {
+			remap[*i] = out.size();
+			out.push_back((*vertices)[*i]);
+		}
+		*i = remap[*i];
+	}
+	vertices->swap(out);
+}
+
+/*
+ * Pick a LOD from the size of the bounding sphere on screen. Works for any
+ * modelview with uniform scale.
+ */
+int select_lod(const GLdouble *mdl, const GLdouble *proj, const vec3 &center,
+	       double radius, int num_lods)
+{
+	vec3 eye(mdl[0] * center.x + mdl[4] * center.y + mdl[8] * center.z + mdl[12],
+		 mdl[1] * center.x + mdl[5] * center.y + mdl[9] * center.z + mdl[13],
+		 mdl[2] * center.x + mdl[6] * center.y + mdl[10] * center.z + mdl[14]);
+	double scale = length(vec3(mdl[0], mdl[1], mdl[2]));
+	double dist = length(eye);
+	if (dist <= radius * scale)
+		return 0;
+
+	double pixels = radius * scale * proj[5] * screen->h / dist;
+	double threshold = LOD_PIXELS;
+	int lod = 0;
+	while (lod < num_lods - 1 && pixels < threshold) {
+		threshold *= 0.5;
+		lod++;
+	}
+	return lod;
+}
+
+void add_point(AABB *box, const vec3 &p)
+{
+	box->min = vec3(std::min(box->min.x, p.x), std::min(box->min.y, p.y),
+			std::min(box->min.z, p.z));
+	box->max = vec3(std::max(box->max.x, p.x), std::max(box->max.y, p.y),
+			std::max(box->max.z, p.z));
 }
 
 void print_shader_log(GLuint obj)
@@ -93,6 +365,30 @@ void print_shader_log(GLuint obj)
 	}
 }
 
+GLuint compile_shader(GLenum type, const char *source)
+{
+	GLuint shader = glCreateShader(type);
+	glShaderSource(shader, 1, &source, NULL);
+	glCompileShader(shader);
+	if (debug_enabled) {
+		print_shader_log(shader);
+	}
+	return shader;
+}
+
+void link_program(GLuint program)
+{
+	glLinkProgram(program);
+	if (debug_enabled) {
+		print_shader_log(program);
+	}
+	int status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status) {
+		throw std::runtime_error("Loading OpenGL program failed");
+	}
+}
+
 }
 
 void check_gl_errors()
@@ -120,9 +416,369 @@ void verify_state_disabled(GLenum state)
 	}
 }
 
-GLuint load_png(const char *fname)
+namespace {
+
+int num_components(GLenum format)
+{
+	switch (format) {
+	case GL_ALPHA:
+		return 1;
+	case GL_RGB:
+		return 3;
+	case GL_RGBA:
+		return 4;
+	}
+	assert(0);
+	return 0;
+}
+
+/* 2x2 box filter */
+void make_mipmap(Image *dst, const Image *src)
+{
+	int components = num_components(src->format);
+	dst->width = std::max(src->width / 2, 1);
+	dst->height = std::max(src->height / 2, 1);
+	dst->format = src->format;
+	dst->pixels.resize(dst->width * dst->height * components);
+	const unsigned char *pixels = (const unsigned char *) &src->pixels[0];
+	int stride = src->width * components;
+	char *out = &dst->pixels[0];
+	for (int y = 0; y < dst->height; ++y) {
+		const unsigned char *row0 =
+			pixels + std::min(y * 2, src->height - 1) * stride;
+		const unsigned char *row1 =
+			pixels + std::min(y * 2 + 1, src->height - 1) * stride;
+		for (int x = 0; x < dst->width; ++x) {
+			int x0 = std::min(x * 2, src->width - 1) * components;
+			int x1 = std::min(x * 2 + 1, src->width - 1) * components;
+			for (int c = 0; c < components; ++c) {
+				int sum = row0[x0 + c] + row0[x1 + c] +
+					  row1[x0 + c] + row1[x1 + c];
+				*out++ = (sum + 2) / 4;
+			}
+		}
+	}
+}
+
+int mip_levels(int width, int height)
+{
+	int levels = 1;
+	for (int size = std::max(width, height); size > 1; size /= 2) {
+		levels++;
+	}
+	return levels;
+}
+
+/* Bound, with the levels to be filled in */
+GLuint new_texture(int levels)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+			GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	return texture;
+}
+
+struct ImageHeader {
+	int32_t width, height;
+	uint32_t format;
+	int32_t levels;
+};
+
+/* Every mip level is stored, tightly packed */
+GLuint upload_image_asset(const Asset *asset)
+{
+	AssetReader reader(asset);
+	ImageHeader header = reader.get<ImageHeader>();
+	int components = num_components(header.format);
+
+	GLuint texture = new_texture(header.levels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	int width = header.width, height = header.height;
+	for (int level = 0; level < header.levels; ++level) {
+		const char *pixels = reader.skip(width * height * components);
+		glTexImage2D(GL_TEXTURE_2D, level, header.format, width,
+			     height, 0, header.format, GL_UNSIGNED_BYTE,
+			     pixels);
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	return texture;
+}
+
+const char TEXTURE_CACHE_MAGIC[8] = {'S', 'E', 'K', 'O', 'T', 'E', 'X', '1'};
+
+/* Followed by the size and data of each level */
+struct TextureCacheHeader {
+	char magic[8];
+	int32_t width, height;
+	uint32_t format;
+	/* zero if stored as it is */
+	uint32_t compressed;
+	int32_t levels;
+};
+
+/* Alpha-only pictures are small and stay as they are */
+GLenum compressed_format(GLenum format)
+{
+	if (!compress_textures || !GLEW_EXT_texture_compression_s3tc)
+		return 0;
+	switch (format) {
+	case GL_RGB:
+		return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	case GL_RGBA:
+		return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+	}
+	return 0;
+}
+
+struct TextureCache {
+	TextureCacheHeader header;
+	std::vector<const char *> pixels;
+	std::vector<uint32_t> sizes;
+};
+
+/* False if it is broken or would be baked differently now */
+bool parse_texture_cache(TextureCache *cache, const std::string &data)
+{
+	TextureCacheHeader &header = cache->header;
+	if (data.size() < sizeof header)
+		return false;
+	memcpy(&header, data.data(), sizeof header);
+	if (memcmp(header.magic, TEXTURE_CACHE_MAGIC, sizeof header.magic) ||
+	    header.compressed != compressed_format(header.format) ||
+	    header.levels != mip_levels(header.width, header.height))
+		return false;
+
+	cache->pixels.clear();
+	cache->sizes.clear();
+	size_t pos = sizeof header;
+	int width = header.width, height = header.height;
+	for (int level = 0; level < header.levels; ++level) {
+		uint32_t size;
+		if (data.size() - pos < sizeof size)
+			return false;
+		memcpy(&size, &data[pos], sizeof size);
+		pos += sizeof size;
+		if (data.size() - pos < size)
+			return false;
+		if (!header.compressed &&
+		    size != unsigned(width * height *
+				     num_components(header.format)))
+			return false;
+		cache->pixels.push_back(&data[pos]);
+		cache->sizes.push_back(size);
+		pos += size;
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	return true;
+}
+
+GLuint upload_texture_cache(const TextureCache &cache)
+{
+	const TextureCacheHeader &header = cache.header;
+	GLuint texture = new_texture(header.levels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	int width = header.width, height = header.height;
+	for (int level = 0; level < header.levels; ++level) {
+		if (header.compressed) {
+			glCompressedTexImage2D(GL_TEXTURE_2D, level,
+					       header.compressed, width, height,
+					       0, cache.sizes[level],
+					       cache.pixels[level]);
+		} else {
+			glTexImage2D(GL_TEXTURE_2D, level, header.format, width,
+				     height, 0, header.format, GL_UNSIGNED_BYTE,
+				     cache.pixels[level]);
+		}
+		width = std::max(width / 2, 1);
+		height = std::max(height / 2, 1);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	return texture;
+}
+
+/*
+ * Uploads every level, made here instead of by the driver, and leaves
+ * the picture at the smallest one. Compressed levels are read back so
+ * the driver's encoder only runs once.
+ */
+GLuint bake_texture(Image *image, std::string *out)
+{
+	TextureCacheHeader header;
+	memcpy(header.magic, TEXTURE_CACHE_MAGIC, sizeof header.magic);
+	header.width = image->width;
+	header.height = image->height;
+	header.format = image->format;
+	header.compressed = compressed_format(image->format);
+	header.levels = mip_levels(image->width, image->height);
+	put(out, header);
+
+	GLuint texture = new_texture(header.levels);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	std::vector<char> compressed;
+	for (int level = 0; level < header.levels; ++level) {
+		GLenum internal = header.compressed ? header.compressed :
+				  image->format;
+		glTexImage2D(GL_TEXTURE_2D, level, internal, image->width,
+			     image->height, 0, image->format, GL_UNSIGNED_BYTE,
+			     &image->pixels[0]);
+		if (header.compressed) {
+			GLint size = 0;
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, level,
+					GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			compressed.resize(size);
+			glGetCompressedTexImage(GL_TEXTURE_2D, level,
+						&compressed[0]);
+			put(out, uint32_t(size));
+			out->append(compressed.begin(), compressed.end());
+		} else {
+			put(out, uint32_t(image->pixels.size()));
+			out->append(image->pixels.begin(), image->pixels.end());
+		}
+		if (level < header.levels - 1) {
+			Image next;
+			make_mipmap(&next, image);
+			std::swap(image->width, next.width);
+			std::swap(image->height, next.height);
+			image->pixels.swap(next.pixels);
+		}
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	return texture;
+}
+
+/* read() needs no GL and can run on a loader thread */
+struct TextureLoad {
+	std::string fname;
+	const Asset *asset;
+	std::string cache_name, cached;
+	TextureCache cache;
+	Image image;
+	/* of every level, known after upload() */
+	size_t bytes;
+
+	void read();
+	GLuint upload();
+};
+
+void TextureLoad::read()
+{
+	asset = find_asset(fname, ASSET_IMAGE);
+	if (asset != NULL) {
+		debug("loading %s\n", fname.c_str());
+		return;
+	}
+
+	std::string png = read_file(fname.c_str());
+	uint64_t hash = fnv1a(png.data(), png.size());
+	cache_name = cache_file(strf("tex-%016llx",
+				     (unsigned long long) hash));
+
+	FILE *f = fopen(cache_name.c_str(), "rb");
+	if (f != NULL) {
+		fclose(f);
+		cached = read_file(cache_name.c_str());
+		if (parse_texture_cache(&cache, cached)) {
+			debug("loading %s from %s\n", fname.c_str(),
+			      cache_name.c_str());
+			return;
+		}
+		cached.clear();
+	}
+	load_image(&image, fname.c_str());
+}
+
+GLuint TextureLoad::upload()
+{
+	if (asset != NULL) {
+		bytes = asset->size - sizeof(ImageHeader);
+		return upload_image_asset(asset);
+	}
+	if (!cached.empty()) {
+		bytes = 0;
+		FOR_EACH_CONST(std::vector<uint32_t>, size, cache.sizes) {
+			bytes += *size;
+		}
+		return upload_texture_cache(cache);
+	}
+	int levels = mip_levels(image.width, image.height);
+	std::string data;
+	GLuint texture = bake_texture(&image, &data);
+	bytes = data.size() - sizeof(TextureCacheHeader) -
+		levels * sizeof(uint32_t);
+	if (!write_file(cache_name.c_str(), data)) {
+		warning("Can not write: %s\n", cache_name.c_str());
+	}
+	return texture;
+}
+
+class TextureJob : public LoadJob {
+public:
+	TextureJob(GLuint *texture, size_t *bytes, const char *fname) :
+		m_texture(texture), m_bytes(bytes)
+	{
+		m_load.fname = fname;
+	}
+
+	void load() { m_load.read(); }
+
+	void finish()
+	{
+		*m_texture = m_load.upload();
+		if (m_bytes != NULL) {
+			*m_bytes = m_load.bytes;
+		}
+	}
+
+private:
+	GLuint *m_texture;
+	size_t *m_bytes;
+	TextureLoad m_load;
+};
+
+/* Transparent white, drawn until the real one is uploaded */
+GLuint placeholder_texture()
+{
+	static GLuint texture = INVALID_TEXTURE;
+	if (texture == INVALID_TEXTURE) {
+		const unsigned char pixel[4] = {255, 255, 255, 0};
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+				GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
+				GL_NEAREST);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA,
+			     GL_UNSIGNED_BYTE, pixel);
+	}
+	return texture;
+}
+
+}
+
+void load_image(Image *image, const char *fname)
 {
 	debug("loading %s\n", fname);
+	const Asset *asset = find_asset(fname, ASSET_IMAGE);
+	if (asset != NULL) {
+		AssetReader reader(asset);
+		ImageHeader header = reader.get<ImageHeader>();
+		image->width = header.width;
+		image->height = header.height;
+		image->format = header.format;
+		size_t size = header.width * header.height *
+			      num_components(header.format);
+		const char *pixels = reader.skip(size);
+		image->pixels.assign(pixels, pixels + size);
+		return;
+	}
+
 	FILE *f = fopen(fname, "rb");
 	if (f == NULL) {
 		throw std::runtime_error(strf("Can not open: %s", fname));
@@ -147,33 +803,38 @@ GLuint load_png(const char *fname)
 		throw std::runtime_error(strf("Non-power-of-two: %s", fname));
 	}
 
-	int type = 0, components;
+	int components;
 	switch (png_get_color_type(png_ptr, info_ptr)) {
 	case PNG_COLOR_TYPE_GRAY:
-		type = GL_ALPHA;
+		image->format = GL_ALPHA;
 		components = 1;
 		break;
 	case PNG_COLOR_TYPE_RGB:
-		type = GL_RGB;
+		image->format = GL_RGB;
 		components = 3;
 		break;
 	case PNG_COLOR_TYPE_RGB_ALPHA:
-		type = GL_RGBA;
+		image->format = GL_RGBA;
 		components = 4;
 		break;
 	default:
 		throw std::runtime_error(strf("Wrong color type: %s", fname));
 	}
 
-	std::vector<char> pixels(width * height * components, 0);
+	image->width = width;
+	image->height = height;
+	image->pixels.assign(width * height * components, 0);
 	std::vector<png_bytep> rows(height);
 	for (int i = 0; i < height; ++i) {
-		rows[i] = png_bytep(&pixels[width * components * i]);
+		rows[i] = png_bytep(&image->pixels[width * components * i]);
 	}
 	png_read_image(png_ptr, &rows[0]);
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 	fclose(f);
+}
 
+GLuint upload_texture(const Image *image)
+{
 	GLuint texture;
 	glGenTextures(1, &texture);
 	glBindTexture(GL_TEXTURE_2D, texture);
@@ -181,171 +842,619 @@ GLuint load_png(const char *fname)
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
 			GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_GENERATE_MIPMAP, GL_TRUE);
-	glTexImage2D(GL_TEXTURE_2D, 0, type, width, height, 0,
-		     type, GL_UNSIGNED_BYTE, &pixels[0]);
+	glTexImage2D(GL_TEXTURE_2D, 0, image->format, image->width,
+		     image->height, 0, image->format, GL_UNSIGNED_BYTE,
+		     &image->pixels[0]);
 	return texture;
 }
 
-void load_mesh(Mesh *mesh, const char *fname, double scale, const vec3 &origo)
+GLuint load_png(const char *fname)
 {
-	std::ifstream f(fname);
-	if (!f) {
-		throw std::runtime_error(strf("Can not open %s", fname));
-	}
-	std::string line;
-	Group *group = NULL;
-	while (std::getline(f, line)) {
-		std::istringstream parser(line);
-		std::string token;
-		parser >> token;
-		if (!parser || token[0] == '#')
-			continue;
+	TextureLoad load;
+	load.fname = fname;
+	load.read();
+	return load.upload();
+}
 
-		if (token == "v") {
-			vec3 p;
-			parser >> p.x >> p.y >> p.z;
-			mesh->vertices.push_back(p * scale + origo);
-			if (!parser) {
-				throw std::runtime_error("Corrupted mesh file");
-			}
-		} else if (token == "vn") {
-			vec3 v;
-			parser >> v.x >> v.y >> v.z;
-			mesh->normals.push_back(v);
-			if (!parser) {
-				throw std::runtime_error("Corrupted mesh file");
-			}
-		} else if (token == "mtllib") {
-			std::string name;
-			parser >> name;
-			load_materials(mesh->groups, name.c_str());
-		} else if (token == "usemtl") {
-			std::string name;
-			parser >> name;
-			std::pair<group_map_t::iterator, bool> res =
-				mesh->groups.insert(std::make_pair(name, Group()));
-			group = &res.first->second;
-		} else if (token == "f") {
-			Face f;
-			for (int i = 0; i < 3; ++i) {
-				size_t idx;
-				parser >> idx;
-				if (!parser) {
-					break;
-				}
-				assert(idx > 0 && idx <= mesh->vertices.size());
-				f.vert[i] = idx - 1;
-				if (parser.peek() == '/') {
-					parser.get();
-					if (parser.peek() != '/') {
-						parser >> idx;
-					}
-				}
-				if (parser.peek() == '/') {
-					parser.get();
-					parser >> idx;
-					assert(idx > 0 &&
-					       idx <= mesh->normals.size());
-					f.norm[i] = idx - 1;
-				}
-				if (i == 2) {
-					group->faces.push_back(f);
-				}
-			}
+void load_png_async(GLuint *texture, const char *fname, size_t *bytes)
+{
+	debug("queuing %s\n", fname);
+	*texture = placeholder_texture();
+	start_load(new TextureJob(texture, bytes, fname));
+}
+
+void pack_image(const char *fname, std::string *out)
+{
+	Image image;
+	load_image(&image, fname);
+
+	ImageHeader header;
+	header.width = image.width;
+	header.height = image.height;
+	header.format = image.format;
+	header.levels = mip_levels(image.width, image.height);
+	put(out, header);
+	for (int level = 0; level < header.levels; ++level) {
+		out->append(image.pixels.begin(), image.pixels.end());
+		if (level < header.levels - 1) {
+			Image next;
+			make_mipmap(&next, &image);
+			std::swap(image.width, next.width);
+			std::swap(image.height, next.height);
+			image.pixels.swap(next.pixels);
 		}
 	}
 }
 
-Model::Model()
+/* Everything that is made before the GL objects */
+struct Model::Staging {
+	std::list<ModelGroup> groups;
+	AABB bounds;
+	std::vector<ModelVertex> vertices;
+	std::vector<unsigned> indices;
+};
+
+class Model::Job : public LoadJob {
+public:
+	Job(Model *model, const char *fname, double scale, const vec3 &origo) :
+		m_model(model), m_fname(fname), m_scale(scale), m_origo(origo)
+	{}
+
+	~Job()
+	{
+		if (!cancelled()) {
+			m_model->m_job = NULL;
+		}
+	}
+
+	void load()
+	{
+		build(&m_staging, m_fname.c_str(), m_scale, m_origo);
+	}
+
+	void finish()
+	{
+		m_model->upload(&m_staging, m_fname.c_str());
+	}
+
+private:
+	Model *m_model;
+	std::string m_fname;
+	double m_scale;
+	vec3 m_origo;
+	Staging m_staging;
+};
+
+Model::Model() :
+	m_vertex_buffer(0), m_index_buffer(0), m_gpu_bytes(0), m_job(NULL)
 {
 }
 
 Model::~Model()
 {
-	FOR_EACH(std::list<ModelGroup>, group, m_groups) {
-		glDeleteBuffers(1, &group->buffer);
+	cancel_load();
+	clear();
+}
+
+void Model::cancel_load()
+{
+	if (m_job != NULL) {
+		m_job->cancel();
+		m_job = NULL;
 	}
 }
 
+void Model::clear()
+{
+	if (m_vertex_buffer) {
+		glDeleteBuffers(1, &m_vertex_buffer);
+		glDeleteBuffers(1, &m_index_buffer);
+		m_vertex_buffer = 0;
+		m_index_buffer = 0;
+	}
+	m_gpu_bytes = 0;
+	m_groups.clear();
+}
+
 void Model::load(const char *fname, double scale, const vec3 &origo)
+{
+	cancel_load();
+	Staging staging;
+	build(&staging, fname, scale, origo);
+	upload(&staging, fname);
+}
+
+void Model::load_async(const char *fname, double scale, const vec3 &origo)
+{
+	debug("queuing %s\n", fname);
+	cancel_load();
+	clear();
+	m_job = new Job(this, fname, scale, origo);
+	start_load(m_job);
+}
+
+/* Does not touch the model, so it can run on a loader thread */
+void Model::build(Staging *staging, const char *fname, double scale,
+		  const vec3 &origo)
 {
 	debug("loading %s\n", fname);
 
-	FOR_EACH(std::list<ModelGroup>, group, m_groups) {
-		glDeleteBuffers(1, &group->buffer);
-	}
-	m_groups.clear();
+	staging->bounds.min = vec3(1e30, 1e30, 1e30);
+	staging->bounds.max = vec3(-1e30, -1e30, -1e30);
 
 	Mesh mesh;
 	load_mesh(&mesh, fname, scale, origo);
 
-	/* upload to GPU */
+	/* the simplification is slow, so its results are cached */
+	size_t num_groups = 0;
 	FOR_EACH_CONST(group_map_t, iter, mesh.groups) {
-		const Group *group = &iter->second;
-		std::vector<GLVertex> buf(group->faces.size() * 3);
-		for (size_t j = 0; j < group->faces.size(); ++j) {
-			const Face *face = &group->faces[j];
-			for (int i = 0; i < 3; ++i) {
-				vec3 p = mesh.vertices[face->vert[i]];
-				vec3 n = mesh.normals[face->norm[i]];
-				GLVertex gv;
-				gv.pos[0] = p.x;
-				gv.pos[1] = p.y;
-				gv.pos[2] = p.z;
-				gv.normal[0] = n.x;
-				gv.normal[1] = n.y;
-				gv.normal[2] = n.z;
-				gv.texcoord[0] = (p.x + p.y) * 0.3;
-				gv.texcoord[1] = (p.z + p.y) * 0.3;
-				buf[j * 3 + i] = gv;
+		if (!iter->second.faces.empty())
+			num_groups++;
+	}
+	std::string cache = lod_cache_name(mesh);
+	std::vector<lod_list_t> lods;
+	FILE *f = fopen(cache.c_str(), "rb");
+	bool cached = false;
+	if (f != NULL) {
+		fclose(f);
+		cached = read_lod_cache(&lods, read_file(cache.c_str()), mesh,
+					num_groups);
+	}
+	if (cached) {
+		debug("loading LODs from %s\n", cache.c_str());
+	} else {
+		lods.assign(num_groups, lod_list_t());
+		size_t i = 0;
+		FOR_EACH_CONST(group_map_t, iter, mesh.groups) {
+			if (!iter->second.faces.empty()) {
+				simplify_lods(&lods[i++], mesh,
+					      iter->second.faces);
 			}
 		}
-		debug("%s: %zd\n", iter->first.c_str(), buf.size());
+		write_lod_cache(cache.c_str(), lods);
+	}
+
+	std::vector<ModelVertex> &vertices = staging->vertices;
+	std::vector<unsigned> &indices = staging->indices;
+	vertex_map_t vertex_map;
+	int group_index = 0;
+	FOR_EACH_CONST(group_map_t, iter, mesh.groups) {
+		const Group *group = &iter->second;
+		if (group->faces.empty())
+			continue;
+
 		ModelGroup mgroup;
 		mgroup.diffuse = group->diffuse;
-		mgroup.count = buf.size();
-		glGenBuffers(1, &mgroup.buffer);
-		glBindBuffer(GL_ARRAY_BUFFER, mgroup.buffer);
-		glBufferData(GL_ARRAY_BUFFER, sizeof(GLVertex) * buf.size(),
-			     &buf[0], GL_STATIC_DRAW);
-		m_groups.push_back(mgroup);
+		mgroup.num_lods = 0;
+
+		mgroup.box.min = vec3(1e30, 1e30, 1e30);
+		mgroup.box.max = vec3(-1e30, -1e30, -1e30);
+		FOR_EACH_CONST(std::vector<Face>, face, group->faces) {
+			for (int i = 0; i < 3; ++i) {
+				add_point(&mgroup.box, mesh.vertices[face->vert[i]]);
+			}
+		}
+		add_point(&staging->bounds, mgroup.box.min);
+		add_point(&staging->bounds, mgroup.box.max);
+
+		const lod_list_t &group_lods = lods[group_index];
+		for (size_t i = 0; i <= group_lods.size(); ++i) {
+			ModelLOD *lod = &mgroup.lods[mgroup.num_lods++];
+			add_faces(lod, &vertices, &indices, &vertex_map, mesh,
+				  i == 0 ? group->faces : group_lods[i - 1],
+				  group->diffuse, group_index);
+			debug("%s: LOD %d: %zd\n", iter->first.c_str(),
+			      mgroup.num_lods - 1, lod->count);
+		}
+		staging->groups.push_back(mgroup);
+		group_index++;
+	}
+	if (!indices.empty()) {
+		reorder_vertices(&vertices, &indices);
 	}
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-void Model::draw(bool noise)
+void Model::upload(Staging *staging, const char *fname)
 {
-	static GLuint noise_tex = INVALID_TEXTURE;
-	if (noise_tex == INVALID_TEXTURE) {
-		noise_tex = load_png("noise.png");
+	clear();
+	m_groups.swap(staging->groups);
+	m_bounds = staging->bounds;
+	const std::vector<ModelVertex> &vertices = staging->vertices;
+	const std::vector<unsigned> &indices = staging->indices;
+	if (indices.empty())
+		return;
+
+	/* upload to GPU */
+	size_t vertex_size;
+	glGenBuffers(1, &m_vertex_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
+	m_quantized = quantize_models;
+	if (m_quantized) {
+		/* uniform scale, so the normals only need rescaling */
+		vec3 extent = m_bounds.max - m_bounds.min;
+		m_decode_offset = (m_bounds.min + m_bounds.max) * 0.5;
+		m_decode_scale = std::max(std::max(extent.x, extent.y),
+					  extent.z) * 0.5 / 32767;
+		if (m_decode_scale <= 0) {
+			m_decode_scale = 1;
+		}
+		std::vector<PackedVertex> packed;
+		pack_vertices(&packed, vertices, m_decode_offset,
+			      m_decode_scale);
+		vertex_size = sizeof(PackedVertex);
+		glBufferData(GL_ARRAY_BUFFER, vertex_size * packed.size(),
+			     &packed[0], GL_STATIC_DRAW);
+	} else {
+		vertex_size = sizeof(ModelVertex);
+		glBufferData(GL_ARRAY_BUFFER, vertex_size * vertices.size(),
+			     &vertices[0], GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glGenBuffers(1, &m_index_buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
+	if (vertices.size() <= 0x10000) {
+		std::vector<GLushort> shorts(indices.begin(), indices.end());
+		m_index_type = GL_UNSIGNED_SHORT;
+		m_index_size = sizeof(GLushort);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			     sizeof(GLushort) * shorts.size(), &shorts[0],
+			     GL_STATIC_DRAW);
+	} else {
+		m_index_type = GL_UNSIGNED_INT;
+		m_index_size = sizeof(GLuint);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+			     sizeof(GLuint) * indices.size(), &indices[0],
+			     GL_STATIC_DRAW);
 	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	m_gpu_bytes = vertex_size * vertices.size() +
+		      m_index_size * indices.size();
+
+	debug("%s: %zd vertices of %zd bytes, %zd indices of %zd bytes, "
+	      "%.1f KB (%.1f KB unquantized)\n", fname, vertices.size(),
+	      vertex_size, indices.size(), m_index_size,
+	      m_gpu_bytes / 1024.0,
+	      (sizeof(ModelVertex) * vertices.size() +
+	       m_index_size * indices.size()) / 1024.0);
+}
+
+void Model::draw(GLuint noise)
+{
 	GLState state;
 	GLClientState cstate;
 
-	if (noise) {
-		glBindTexture(GL_TEXTURE_2D, noise_tex);
+	if (noise != INVALID_TEXTURE) {
+		glBindTexture(GL_TEXTURE_2D, noise);
 		state.enable(GL_TEXTURE_2D);
-		cstate.enable(GL_TEXTURE_COORD_ARRAY);
 	}
 	cstate.enable(GL_VERTEX_ARRAY);
 	cstate.enable(GL_NORMAL_ARRAY);
+	cstate.enable(GL_COLOR_ARRAY);
+	glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
+	state.enable(GL_COLOR_MATERIAL);
+
+	glBindBuffer(GL_ARRAY_BUFFER, m_vertex_buffer);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_index_buffer);
+	if (m_quantized) {
+		const PackedVertex *v = NULL;
+		glVertexPointer(3, GL_SHORT, sizeof(PackedVertex), v->pos);
+		glNormalPointer(GL_BYTE, sizeof(PackedVertex), v->normal);
+		glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(PackedVertex),
+			       v->color);
+		state.enable(GL_RESCALE_NORMAL);
+		if (noise != INVALID_TEXTURE) {
+			/* same as the texcoords of ModelVertex */
+			double s = m_decode_scale * 0.3;
+			const vec3 &o = m_decode_offset;
+			GLdouble splane[] = {s, s, 0, (o.x + o.y) * 0.3};
+			GLdouble tplane[] = {0, s, s, (o.z + o.y) * 0.3};
+			glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+			glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, GL_OBJECT_LINEAR);
+			glTexGendv(GL_S, GL_OBJECT_PLANE, splane);
+			glTexGendv(GL_T, GL_OBJECT_PLANE, tplane);
+			state.enable(GL_TEXTURE_GEN_S);
+			state.enable(GL_TEXTURE_GEN_T);
+		}
+	} else {
+		const ModelVertex *v = NULL;
+		glVertexPointer(3, GL_FLOAT, sizeof(ModelVertex), v->pos);
+		glNormalPointer(GL_FLOAT, sizeof(ModelVertex), v->normal);
+		glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(ModelVertex),
+			       v->color);
+		if (noise != INVALID_TEXTURE) {
+			cstate.enable(GL_TEXTURE_COORD_ARRAY);
+			glTexCoordPointer(2, GL_FLOAT, sizeof(ModelVertex),
+					  v->texcoord);
+		}
+	}
+
+	GLdouble mdl[16], proj[16];
+	glGetDoublev(GL_MODELVIEW_MATRIX, mdl);
+	glGetDoublev(GL_PROJECTION_MATRIX, proj);
+
+	/* in object space, so the boxes need no transforming */
+	Frustum frustum;
+	extract_frustum(&frustum, proj, mdl);
 
 	FOR_EACH_CONST(std::list<ModelGroup>, group, m_groups) {
-		glMaterialfv(GL_FRONT, GL_AMBIENT_AND_DIFFUSE,
-			     &group->diffuse.r);
-		glBindBuffer(GL_ARRAY_BUFFER, group->buffer);
-		const GLVertex *v = NULL;
-		glVertexPointer(3, GL_FLOAT, sizeof(GLVertex), v->pos);
-		glNormalPointer(GL_FLOAT, sizeof(GLVertex), v->normal);
-		glTexCoordPointer(2, GL_FLOAT, sizeof(GLVertex), v->texcoord);
+		if (!box_visible(&frustum, group->box)) {
+			cull_stats.groups_culled++;
+			continue;
+		}
+		cull_stats.groups_drawn++;
 
-		glDrawArrays(GL_TRIANGLES, 0, group->count);
+		vec3 center = (group->box.min + group->box.max) * 0.5;
+		double radius = length(group->box.max - group->box.min) * 0.5;
+		const ModelLOD *lod = &group->lods[
+			select_lod(mdl, proj, center, radius, group->num_lods)];
+		m_counts.push_back(lod->count);
+		m_offsets.push_back((const GLvoid *) (lod->first * m_index_size));
 	}
+
+	if (!m_counts.empty()) {
+		glPushMatrix();
+		if (m_quantized) {
+			glTranslated(m_decode_offset.x, m_decode_offset.y,
+				     m_decode_offset.z);
+			glScaled(m_decode_scale, m_decode_scale,
+				 m_decode_scale);
+		}
+		glMultiDrawElements(GL_TRIANGLES, &m_counts[0], m_index_type,
+				    &m_offsets[0], m_counts.size());
+		glPopMatrix();
+	}
+	m_counts.clear();
+	m_offsets.clear();
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	/* the color array leaves the current color undefined */
+	glColor4f(1, 1, 1, 1);
+}
+
+namespace {
+
+struct TextVertex {
+	float pos[2], texcoord[2];
+};
+
+const char *sdf_vs =
+"varying vec2 tc;\
+void main(void)\
+{\
+	gl_Position = ftransform();\
+	gl_FrontColor = gl_Color;\
+	tc = gl_MultiTexCoord0.xy;\
+}";
+
+/* Antialiased over about one screen pixel, whatever the scale */
+const char *sdf_fs =
+"uniform sampler2D tex;\
+varying vec2 tc;\
+void main(void)\
+{\
+	float dist = texture2D(tex, tc).a;\
+	float width = fwidth(dist);\
+	float alpha = smoothstep(0.5 - width, 0.5 + width, dist);\
+	gl_FragColor = vec4(gl_Color.rgb, gl_Color.a * alpha);\
+}";
+
+struct GlyphBitmap {
+	int width, rows;
+	std::vector<unsigned char> pixels;
+};
+
+struct TallerBitmap {
+	const std::vector<GlyphBitmap> *bitmaps;
+
+	TallerBitmap(const std::vector<GlyphBitmap> *i_bitmaps) :
+		bitmaps(i_bitmaps)
+	{}
+
+	bool operator ()(size_t a, size_t b) const
+	{
+		return (*bitmaps)[a].rows > (*bitmaps)[b].rows;
+	}
+};
+
+/*
+ * Bottom-left skyline packer: keeps the top edge of the packed
+ * rectangles as segments and puts each new one where it ends up lowest.
+ */
+class Skyline {
+public:
+	Skyline(int width, int height) :
+		m_width(width), m_height(height)
+	{
+		Segment s = {0, 0, width};
+		m_segments.push_back(s);
+	}
+
+	bool insert(int width, int height, int *x, int *y)
+	{
+		size_t best = m_segments.size();
+		int best_y = m_height;
+		for (size_t i = 0; i < m_segments.size(); ++i) {
+			int top = fit(i, width);
+			if (top >= 0 && top + height <= m_height &&
+			    top < best_y) {
+				best = i;
+				best_y = top;
+			}
+		}
+		if (best == m_segments.size())
+			return false;
+
+		*x = m_segments[best].x;
+		*y = best_y;
+		Segment s = {*x, best_y + height, width};
+		m_segments.insert(m_segments.begin() + best, s);
+
+		/* cut away what the new segment covers */
+		size_t i = best + 1;
+		while (i < m_segments.size()) {
+			Segment *next = &m_segments[i];
+			int shrink = s.x + s.width - next->x;
+			if (shrink <= 0)
+				break;
+			if (shrink < next->width) {
+				next->x += shrink;
+				next->width -= shrink;
+				break;
+			}
+			m_segments.erase(m_segments.begin() + i);
+		}
+		merge();
+		return true;
+	}
+
+private:
+	struct Segment {
+		int x, y, width;
+	};
+
+	int m_width, m_height;
+	std::vector<Segment> m_segments;
+
+	/* Lowest y where the rectangle fits starting at segment i */
+	int fit(size_t i, int width) const
+	{
+		if (m_segments[i].x + width > m_width)
+			return -1;
+		int top = 0;
+		int left = width;
+		while (left > 0) {
+			top = std::max(top, m_segments[i].y);
+			left -= m_segments[i].width;
+			i++;
+		}
+		return top;
+	}
+
+	void merge()
+	{
+		size_t i = 1;
+		while (i < m_segments.size()) {
+			if (m_segments[i - 1].y == m_segments[i].y) {
+				m_segments[i - 1].width += m_segments[i].width;
+				m_segments.erase(m_segments.begin() + i);
+			} else {
+				i++;
+			}
+		}
+	}
+};
+
+/* Felzenszwalb & Huttenlocher: lower envelope of parabolas rooted at f */
+void distance_transform_1d(const float *f, int n, float *d, int *v, float *z)
+{
+	int k = 0;
+	v[0] = 0;
+	z[0] = -SDF_INF;
+	z[1] = SDF_INF;
+	for (int q = 1; q < n; ++q) {
+		float s;
+		while (true) {
+			int p = v[k];
+			s = ((f[q] + q * q) - (f[p] + p * p)) / (2 * q - 2 * p);
+			if (s > z[k] || k == 0)
+				break;
+			k--;
+		}
+		k++;
+		v[k] = q;
+		z[k] = s;
+		z[k + 1] = SDF_INF;
+	}
+	k = 0;
+	for (int q = 0; q < n; ++q) {
+		while (z[k + 1] < q)
+			k++;
+		d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+	}
+}
+
+/* Squared distance to the nearest zero, in place */
+void distance_transform(std::vector<float> *grid, int width, int height)
+{
+	int n = std::max(width, height);
+	std::vector<float> f(n), d(n), z(n + 1);
+	std::vector<int> v(n);
+	for (int x = 0; x < width; ++x) {
+		for (int y = 0; y < height; ++y) {
+			f[y] = (*grid)[y * width + x];
+		}
+		distance_transform_1d(&f[0], height, &d[0], &v[0], &z[0]);
+		for (int y = 0; y < height; ++y) {
+			(*grid)[y * width + x] = d[y];
+		}
+	}
+	for (int y = 0; y < height; ++y) {
+		float *row = &(*grid)[y * width];
+		distance_transform_1d(row, width, &d[0], &v[0], &z[0]);
+		std::copy(d.begin(), d.begin() + width, row);
+	}
+}
+
+/*
+ * Signed distance of a large glyph bitmap, scaled down by SDF_UPSCALE.
+ * 0.5 is the edge, more is inside.
+ */
+void make_sdf(GlyphBitmap *out, const unsigned char *buffer, int width,
+	      int rows, int pitch)
+{
+	int pad = SDF_SPREAD * SDF_UPSCALE;
+	out->width = (width + 2 * pad + SDF_UPSCALE - 1) / SDF_UPSCALE;
+	out->rows = (rows + 2 * pad + SDF_UPSCALE - 1) / SDF_UPSCALE;
+	int w = out->width * SDF_UPSCALE;
+	int h = out->rows * SDF_UPSCALE;
+
+	std::vector<float> outside(w * h, SDF_INF), inside(w * h, 0);
+	for (int y = 0; y < rows; ++y) {
+		for (int x = 0; x < width; ++x) {
+			if (buffer[y * pitch + x] >= 128) {
+				outside[(y + pad) * w + x + pad] = 0;
+				inside[(y + pad) * w + x + pad] = SDF_INF;
+			}
+		}
+	}
+	distance_transform(&outside, w, h);
+	distance_transform(&inside, w, h);
+
+	const float scale = 1.0 / (SDF_UPSCALE * SDF_UPSCALE);
+	out->pixels.resize(out->width * out->rows);
+	for (int y = 0; y < out->rows; ++y) {
+		for (int x = 0; x < out->width; ++x) {
+			float dist = 0;
+			for (int j = 0; j < SDF_UPSCALE; ++j) {
+				int row = (y * SDF_UPSCALE + j) * w +
+					  x * SDF_UPSCALE;
+				for (int i = 0; i < SDF_UPSCALE; ++i) {
+					dist += sqrt(outside[row + i]) -
+						sqrt(inside[row + i]);
+				}
+			}
+			dist *= scale / SDF_UPSCALE;
+			float a = 0.5 - dist / (2 * SDF_SPREAD);
+			a = std::max(std::min(a, 1.0f), 0.0f);
+			out->pixels[y * out->width + x] = lrint(a * 255);
+		}
+	}
+}
+
+const char FONT_CACHE_MAGIC[8] = {'S', 'E', 'K', 'O', 'S', 'D', 'F', '1'};
+
+struct FontCacheHeader {
+	char magic[8];
+	uint32_t glyph_size;
+	int32_t width, height;
+};
+
 }
 
 GLFont::GLFont() :
-	m_texture(INVALID_TEXTURE)
+	m_texture(INVALID_TEXTURE), m_program(0), m_scale(1)
 {
 }
 
@@ -354,90 +1463,271 @@ GLFont::~GLFont()
 	if (m_texture != INVALID_TEXTURE) {
 		glDeleteTextures(1, &m_texture);
 	}
+	if (m_program) {
+		glDeleteProgram(m_program);
+	}
+	clear_texts();
 }
 
-void GLFont::open(const char *fname, int size)
+void GLFont::clear_texts()
+{
+	FOR_EACH(text_map_t, i, m_texts) {
+		glDeleteBuffers(1, &i->second.buffer);
+	}
+	m_texts.clear();
+	m_lru.clear();
+}
+
+/*
+ * Renders every glyph once, large, and packs their distance fields into a
+ * square atlas. The metrics are in pixels of SDF_SIZE.
+ */
+void GLFont::rasterize(const std::string &font, Image *atlas)
 {
 	FT_Library library;
 	FT_Face face;
 	if (FT_Init_FreeType(&library)) {
 		throw std::runtime_error("Unable to initialize FreeType");
 	}
-	if (FT_New_Face(library, fname, 0, &face)) {
-		throw std::runtime_error(std::string("Unable to open font: ") +
-					 fname);
+	if (FT_New_Memory_Face(library, (const FT_Byte *) font.data(),
+			       font.size(), 0, &face)) {
+		throw std::runtime_error("Unable to open font");
 	}
-	FT_Set_Char_Size(face, size * 64, size * 64, 96, 96);
+	int hires = SDF_SIZE * SDF_UPSCALE;
+	FT_Set_Char_Size(face, hires * 64, hires * 64, 96, 96);
 	FT_GlyphSlot slot = face->glyph;
 
-	/* calculate the total size */
-	int w = 0;
-	int h = 0;
+	std::vector<GlyphBitmap> bitmaps(NUM_GLYPHS);
+	int area = 0;
 	for (size_t i = 0; i < NUM_GLYPHS; ++i) {
+		Glyph *info = &m_glyphs[i];
+		GlyphBitmap *bitmap = &bitmaps[i];
 		FT_Load_Glyph(face, FT_Get_Char_Index(face, i),
 			      FT_LOAD_RENDER);
 
-		w += slot->bitmap.width + 2 * PAD;
-		h = std::max(h, slot->bitmap.rows + 2 * PAD);
+		make_sdf(bitmap, slot->bitmap.buffer, slot->bitmap.width,
+			 slot->bitmap.rows, slot->bitmap.pitch);
+		info->size = vec2(bitmap->width, bitmap->rows);
+		info->offset = vec2(slot->bitmap_left * 1.0 / SDF_UPSCALE,
+				    -slot->bitmap_top * 1.0 / SDF_UPSCALE) -
+			       vec2(SDF_SPREAD, SDF_SPREAD);
+		info->advance = vec2(slot->advance.x / 64.0 / SDF_UPSCALE,
+				     slot->advance.y / 64.0 / SDF_UPSCALE);
+		area += bitmap->width * bitmap->rows;
 	}
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
 
-	w = round_power2(w);
-	h = round_power2(h);
-	std::vector<char> pixels(w * h, 0);
+	/* tallest first packs tightest */
+	std::vector<size_t> order;
+	for (size_t i = 0; i < NUM_GLYPHS; ++i) {
+		order.push_back(i);
+	}
+	std::stable_sort(order.begin(), order.end(), TallerBitmap(&bitmaps));
 
-	int x = 0;
+	int side = round_power2(sqrt(area));
+	std::vector<int> x(NUM_GLYPHS), y(NUM_GLYPHS);
+	while (true) {
+		Skyline skyline(side, side);
+		size_t i = 0;
+		for (; i < order.size(); ++i) {
+			const Glyph *info = &m_glyphs[order[i]];
+			if (!skyline.insert(info->size.x, info->size.y,
+					    &x[order[i]], &y[order[i]]))
+				break;
+		}
+		if (i == order.size())
+			break;
+		side *= 2;
+	}
+
+	atlas->width = side;
+	atlas->height = side;
+	atlas->format = GL_ALPHA;
+	/* far outside */
+	atlas->pixels.assign(side * side, 0);
 	for (size_t i = 0; i < NUM_GLYPHS; ++i) {
 		Glyph *info = &m_glyphs[i];
-		FT_Load_Glyph(face, FT_Get_Char_Index(face, i),
-			      FT_LOAD_RENDER);
+		const GlyphBitmap *bitmap = &bitmaps[i];
+		info->tex_pos = vec2(x[i] * 1.0 / side, y[i] * 1.0 / side);
+		info->tex_size = info->size * (1.0 / side);
+		if (bitmap->pixels.empty())
+			continue;
+		for (int row = 0; row < bitmap->rows; ++row) {
+			memcpy(&atlas->pixels[(y[i] + row) * side + x[i]],
+			       &bitmap->pixels[row * bitmap->width],
+			       bitmap->width);
+		}
+	}
+	debug("SDF font atlas %d x %d\n", side, side);
+}
 
-		info->tex_pos = vec2(x * 1.0 / w, 0);
-		info->tex_size = vec2((slot->bitmap.width + 2 * PAD) * 1.0 / w,
-				   (slot->bitmap.rows + 2 * PAD) * 1.0 / h);
-		info->size = vec2(slot->bitmap.width + 2 * PAD,
-				  slot->bitmap.rows + 2 * PAD);
+/* Glyphs into m_glyphs, returns the atlas pixels or NULL if not valid */
+const char *GLFont::parse_atlas(const char *data, size_t size, int *width,
+				int *height)
+{
+	FontCacheHeader header;
+	if (size < sizeof header)
+		return NULL;
+	memcpy(&header, data, sizeof header);
+	if (memcmp(header.magic, FONT_CACHE_MAGIC, sizeof header.magic) != 0 ||
+	    header.glyph_size != sizeof(Glyph) ||
+	    header.width <= 0 || header.height <= 0 ||
+	    size != sizeof header + sizeof m_glyphs +
+		    size_t(header.width) * header.height)
+		return NULL;
+	memcpy(m_glyphs, data + sizeof header, sizeof m_glyphs);
+	*width = header.width;
+	*height = header.height;
+	return data + sizeof header + sizeof m_glyphs;
+}
 
-		info->offset = vec2(slot->bitmap_left,
-				    -slot->bitmap_top);
-		info->advance = vec2(slot->advance.x / 64.0,
-				     slot->advance.y / 64.0);
+/* Header, glyphs and pixels; the cache file and archive payload */
+std::string GLFont::bake(const char *fname)
+{
+	Image atlas;
+	rasterize(read_file(fname), &atlas);
 
-		for (int y = 0; y < slot->bitmap.rows; ++y) {
-			memcpy(&pixels[(y + PAD) * w + (PAD + x)],
-			       &slot->bitmap.buffer[y * slot->bitmap.width],
-			       slot->bitmap.width);
-		}
-		x += slot->bitmap.width + 2 * PAD;
+	FontCacheHeader header;
+	memcpy(header.magic, FONT_CACHE_MAGIC, sizeof header.magic);
+	header.glyph_size = sizeof(Glyph);
+	header.width = atlas.width;
+	header.height = atlas.height;
+	std::string out;
+	put(&out, header);
+	out.append((const char *) m_glyphs, sizeof m_glyphs);
+	out.append(&atlas.pixels[0], atlas.pixels.size());
+	return out;
+}
+
+std::string GLFont::cached_atlas(const char *fname)
+{
+	std::string font = read_file(fname);
+	uint64_t hash = fnv1a(font.data(), font.size());
+	/* the same atlas serves every size */
+	std::string cache = cache_file(strf("font-%016llx-sdf",
+					    (unsigned long long) hash));
+
+	FILE *f = fopen(cache.c_str(), "rb");
+	if (f != NULL) {
+		fclose(f);
+		std::string data = read_file(cache.c_str());
+		int width, height;
+		if (parse_atlas(data.data(), data.size(), &width, &height))
+			return data;
 	}
-	FT_Done_Face(face);
-	FT_Done_FreeType(library);
 
+	std::string data = bake(fname);
+	if (!write_file(cache.c_str(), data)) {
+		warning("Can not write: %s\n", cache.c_str());
+	}
+	return data;
+}
+
+class GLFont::OpenJob : public LoadJob {
+public:
+	OpenJob(GLFont *font, const char *fname, int size) :
+		m_font(font), m_fname(fname), m_size(size)
+	{}
+
+	void load()
+	{
+		m_font->read_atlas(m_fname.c_str(), &m_cached, &m_data,
+				   &m_data_size);
+	}
+
+	void finish()
+	{
+		m_font->upload_atlas(m_fname.c_str(), m_data, m_data_size,
+				     m_size);
+	}
+
+private:
+	GLFont *m_font;
+	std::string m_fname;
+	int m_size;
+	std::string m_cached;
+	const char *m_data;
+	size_t m_data_size;
+};
+
+/* No GL, the data points to the archive or to the cached string */
+void GLFont::read_atlas(const char *fname, std::string *cached,
+			const char **data, size_t *data_size)
+{
+	debug("loading %s\n", fname);
+	const Asset *asset = find_asset(fname, ASSET_FONT);
+	if (asset != NULL) {
+		*data = asset->data;
+		*data_size = asset->size;
+	} else {
+		*cached = cached_atlas(fname);
+		*data = cached->data();
+		*data_size = cached->size();
+	}
+}
+
+void GLFont::open(const char *fname, int size)
+{
+	std::string cached;
+	const char *data;
+	size_t data_size;
+	read_atlas(fname, &cached, &data, &data_size);
+	upload_atlas(fname, data, data_size, size);
+}
+
+void GLFont::open_async(const char *fname, int size)
+{
+	start_load(new OpenJob(this, fname, size));
+}
+
+void GLFont::upload_atlas(const char *fname, const char *data,
+			  size_t data_size, int size)
+{
+	int width, height;
+	const char *pixels = parse_atlas(data, data_size, &width, &height);
+	if (pixels == NULL) {
+		throw std::runtime_error(strf("Corrupted font atlas: %s",
+					      fname));
+	}
+	m_scale = size * 1.0 / SDF_SIZE;
+	clear_texts();
+
+	if (m_program == 0 && GLEW_VERSION_2_0) {
+		m_program = load_program(sdf_vs, sdf_fs);
+	}
 	if (m_texture == INVALID_TEXTURE) {
 		glGenTextures(1, &m_texture);
 	}
 	glBindTexture(GL_TEXTURE_2D, m_texture);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, w, h, 0,
-		     GL_ALPHA, GL_UNSIGNED_BYTE, pixels.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA, width, height, 0,
+		     GL_ALPHA, GL_UNSIGNED_BYTE, pixels);
 }
 
-void GLFont::draw_text(const vec2 &pos, const std::string &s, double scale) const
+/* Lays the text out at the origin, draw_text() translates it */
+const GLFont::TextMesh *GLFont::cached_text(const std::string &s,
+					    double scale) const
 {
-	GLState state;
-	state.enable(GL_TEXTURE_2D);
-	state.enable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glBindTexture(GL_TEXTURE_2D, m_texture);
-	glBegin(GL_QUADS);
+	text_key_t key(s, scale);
+	text_map_t::iterator found = m_texts.find(key);
+	if (found != m_texts.end()) {
+		m_lru.splice(m_lru.begin(), m_lru, found->second.lru);
+		return &found->second;
+	}
 
-	vec2 line_pos = pos;
+	/* the glyphs are in pixels of SDF_SIZE */
+	scale *= m_scale;
+	std::vector<TextVertex> buf;
+	vec2 line_pos(0, 0);
 	for (size_t i = 0; i < s.size(); ++i) {
 		unsigned char c = s[i];
 		if (c == '\n') {
+			/* the atlas pads every glyph by SDF_SPREAD */
 			const Glyph *info = &m_glyphs['W'];
-			line_pos.x = pos.x;
-			line_pos.y += info->size.y*scale*1.5;
+			line_pos.x = 0;
+			line_pos.y += (info->size.y - 2 * SDF_SPREAD)*scale*1.5;
 			continue;
 		}
 		if (c >= NUM_GLYPHS) {
@@ -446,23 +1736,79 @@ void GLFont::draw_text(const vec2 &pos, const std::string &s, double scale) cons
 		const Glyph *info = &m_glyphs[c];
 
 		vec2 p = line_pos + info->offset * scale;
-		vec2 s = info->size * scale;
-
-		glTexCoord2f(info->tex_pos.x, info->tex_pos.y);
-		glVertex2f(p.x, p.y);
-		glTexCoord2f(info->tex_pos.x,
-			     info->tex_pos.y + info->tex_size.y);
-		glVertex2f(p.x, p.y + s.y);
-		glTexCoord2f(info->tex_pos.x + info->tex_size.x,
-			     info->tex_pos.y + info->tex_size.y);
-		glVertex2f(p.x + s.x, p.y + s.y);
-		glTexCoord2f(info->tex_pos.x + info->tex_size.x,
-			     info->tex_pos.y);
-		glVertex2f(p.x + s.x, p.y);
+		vec2 size = info->size * scale;
+		const double corners[4][2] = {{0, 0}, {0, 1}, {1, 1}, {1, 0}};
+		for (int j = 0; j < 4; ++j) {
+			TextVertex v;
+			v.pos[0] = p.x + size.x * corners[j][0];
+			v.pos[1] = p.y + size.y * corners[j][1];
+			v.texcoord[0] = info->tex_pos.x +
+					info->tex_size.x * corners[j][0];
+			v.texcoord[1] = info->tex_pos.y +
+					info->tex_size.y * corners[j][1];
+			buf.push_back(v);
+		}
 
 		line_pos += info->advance * scale;
 	}
-	glEnd();
+
+	TextMesh mesh;
+	if (m_texts.size() >= MAX_CACHED_TEXTS) {
+		/* reuse the buffer of the oldest one */
+		text_map_t::iterator old = m_texts.find(m_lru.back());
+		mesh.buffer = old->second.buffer;
+		m_texts.erase(old);
+		m_lru.pop_back();
+	} else {
+		glGenBuffers(1, &mesh.buffer);
+	}
+	mesh.count = buf.size();
+	if (!buf.empty()) {
+		glBindBuffer(GL_ARRAY_BUFFER, mesh.buffer);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(TextVertex) * buf.size(),
+			     &buf[0], GL_STATIC_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	m_lru.push_front(key);
+	mesh.lru = m_lru.begin();
+	return &m_texts.insert(std::make_pair(key, mesh)).first->second;
+}
+
+void GLFont::draw_text(const vec2 &pos, const std::string &s, double scale) const
+{
+	const TextMesh *mesh = cached_text(s, scale);
+	if (mesh->count == 0)
+		return;
+
+	GLState state;
+	state.enable(GL_TEXTURE_2D);
+	state.enable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBindTexture(GL_TEXTURE_2D, m_texture);
+	if (m_program) {
+		glUseProgram(m_program);
+	} else {
+		/* hard edges, but still sharp at any scale */
+		state.enable(GL_ALPHA_TEST);
+		glAlphaFunc(GL_GREATER, 0.5);
+	}
+
+	GLClientState client_state;
+	client_state.enable(GL_VERTEX_ARRAY);
+	client_state.enable(GL_TEXTURE_COORD_ARRAY);
+	glBindBuffer(GL_ARRAY_BUFFER, mesh->buffer);
+	const TextVertex *v = NULL;
+	glVertexPointer(2, GL_FLOAT, sizeof(TextVertex), v->pos);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(TextVertex), v->texcoord);
+
+	glPushMatrix();
+	glTranslatef(pos.x, pos.y, 0);
+	glDrawArrays(GL_QUADS, 0, mesh->count);
+	glPopMatrix();
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	if (m_program) {
+		glUseProgram(0);
+	}
 }
 
 void draw_quad(const vec2 &pos, const vec2 &size)
@@ -512,20 +1858,24 @@ void draw_block(const Plane *walls, size_t num_walls)
 	}
 }
 
-void create_fbo(FBO *fbo, int width, int height, bool bilinear)
+void create_fbo(FBO *fbo, int width, int height, bool bilinear,
+		GLenum format, bool depth)
 {
 	debug("creating FBO %d x %d\n", width, height);
 
 	glGenFramebuffersEXT(1, &fbo->fbo);
 	glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, fbo->fbo);
 
-	GLuint depthbuffer;
-	glGenRenderbuffersEXT(1, &depthbuffer);
-	glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, depthbuffer);
-	glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT,
-				 width, height);
-	glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT,
-				GL_RENDERBUFFER_EXT, depthbuffer);
+	fbo->depthbuffer = 0;
+	if (depth) {
+		glGenRenderbuffersEXT(1, &fbo->depthbuffer);
+		glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, fbo->depthbuffer);
+		glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT,
+					 width, height);
+		glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT,
+					GL_DEPTH_ATTACHMENT_EXT,
+					GL_RENDERBUFFER_EXT, fbo->depthbuffer);
+	}
 
 	GLenum filter = GL_NEAREST;
 	if (bilinear) {
@@ -539,8 +1889,8 @@ void create_fbo(FBO *fbo, int width, int height, bool bilinear)
 	glTexParameterf(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MIN_FILTER, filter);
 	glTexParameteri(GL_TEXTURE_RECTANGLE_ARB, GL_TEXTURE_MAG_FILTER, filter);
-	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, GL_RGB, width, height, 0, GL_RGB,
-		     GL_UNSIGNED_BYTE, NULL);
+	glTexImage2D(GL_TEXTURE_RECTANGLE_ARB, 0, format, width, height, 0,
+		     format, GL_UNSIGNED_BYTE, NULL);
 	glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT,
 				GL_TEXTURE_RECTANGLE_ARB, fbo->texture, 0);
 
@@ -553,33 +1903,90 @@ void create_fbo(FBO *fbo, int width, int height, bool bilinear)
 	check_gl_errors();
 }
 
-GLuint load_program(const char *vs_source, const char *fs_source)
+void delete_fbo(FBO *fbo)
 {
-	GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-	glShaderSource(vs, 1, &vs_source, NULL);
-	glCompileShader(vs);
-	if (debug_enabled) {
-		print_shader_log(vs);
+	debug("deleting FBO\n");
+	glDeleteFramebuffersEXT(1, &fbo->fbo);
+	glDeleteTextures(1, &fbo->texture);
+	if (fbo->depthbuffer != 0) {
+		glDeleteRenderbuffersEXT(1, &fbo->depthbuffer);
 	}
+}
 
-	GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-	glShaderSource(fs, 1, &fs_source, NULL);
-	glCompileShader(fs);
-	if (debug_enabled) {
-		print_shader_log(fs);
+/*
+ * Gribb-Hartmann: the planes are sums and differences of the rows of
+ * projection * modelview. If the modelview is the camera only, the frustum
+ * is in world space; with a model transform it is in object space.
+ */
+void extract_frustum(Frustum *frustum, const GLdouble *proj, const GLdouble *mdl)
+{
+	GLdouble clip[16];
+	for (int i = 0; i < 4; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			clip[i * 4 + j] = proj[j] * mdl[i * 4] +
+					  proj[4 + j] * mdl[i * 4 + 1] +
+					  proj[8 + j] * mdl[i * 4 + 2] +
+					  proj[12 + j] * mdl[i * 4 + 3];
+		}
+	}
+
+	for (int i = 0; i < 6; ++i) {
+		int row = i / 2;
+		double sign = (i & 1) ? -1 : 1;
+		vec3 n(clip[3] + clip[row] * sign,
+		       clip[7] + clip[4 + row] * sign,
+		       clip[11] + clip[8 + row] * sign);
+		double w = clip[15] + clip[12 + row] * sign;
+		double l = length(n);
+		Plane *plane = &frustum->planes[i];
+		plane->normal = n * (-1 / l);
+		plane->d = w / l;
 	}
+}
 
+bool box_visible(const Frustum *frustum, const AABB &box)
+{
+	for (int i = 0; i < 6; ++i) {
+		const Plane *plane = &frustum->planes[i];
+		/* the corner furthest inside the plane */
+		vec3 p(plane->normal.x > 0 ? box.min.x : box.max.x,
+		       plane->normal.y > 0 ? box.min.y : box.max.y,
+		       plane->normal.z > 0 ? box.min.z : box.max.z);
+		if (dot(p, plane->normal) - plane->d > 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Some compatibility profile drivers draw nothing unless location 0 is a
+ * per-vertex array, so instanced programs name the attribute to put there.
+ */
+GLuint load_program(const char *vs_source, const char *fs_source,
+		    const char *attrib0)
+{
 	GLuint program = glCreateProgram();
-	glAttachShader(program, vs);
-	glAttachShader(program, fs);
-	glLinkProgram(program);
-	if (debug_enabled) {
-		print_shader_log(program);
+	glAttachShader(program, compile_shader(GL_VERTEX_SHADER, vs_source));
+	glAttachShader(program, compile_shader(GL_FRAGMENT_SHADER, fs_source));
+	if (attrib0) {
+		glBindAttribLocation(program, 0, attrib0);
 	}
-	int status;
-	glGetProgramiv(program, GL_LINK_STATUS, &status);
-	if (!status) {
-		throw std::runtime_error("Loading OpenGL program failed");
+	link_program(program);
+	return program;
+}
+
+/* Vertex shader only, with the given outputs captured interleaved */
+GLuint load_feedback_program(const char *vs_source, const char **varyings,
+			     int num_varyings, const char *attrib0)
+{
+	GLuint program = glCreateProgram();
+	glAttachShader(program, compile_shader(GL_VERTEX_SHADER, vs_source));
+	if (attrib0) {
+		glBindAttribLocation(program, 0, attrib0);
 	}
+	glTransformFeedbackVaryings(program, num_varyings, varyings,
+				    GL_INTERLEAVED_ATTRIBS);
+	link_program(program);
 	return program;
 }
@@ -81,6 +81,13 @@ public:
 	}
 };
 
+/* Rows from the top, GL_ALPHA, GL_RGB or GL_RGBA bytes */
+struct Image {
+	int width, height;
+	GLenum format;
+	std::vector<char> pixels;
+};
+
 struct Face {
 	size_t vert[3], norm[3];
 };
@@ -88,6 +95,9 @@ struct Face {
 struct Group {
 	Color diffuse;
 	std::vector<Face> faces;
+
+	/* White until a Kd line says otherwise */
+	Group() : diffuse(1, 1, 1) {}
 };
 
 typedef std::map<std::string, Group> group_map_t;
@@ -98,28 +108,88 @@ struct Mesh {
 	group_map_t groups;
 };
 
+/* Planes point outwards, like block walls */
+struct Frustum {
+	Plane planes[6];
+};
+
+/* Model groups and whole zombies are counted apart */
+struct CullStats {
+	int groups_drawn, groups_culled;
+	int zombies_drawn, zombies_culled;
+};
+
+extern CullStats cull_stats;
+
+/* Store static models in the compact vertex format */
+extern bool quantize_models;
+/* Store cached textures S3TC compressed if the driver can */
+extern bool compress_textures;
+
 struct GLVertex {
 	float pos[3], normal[3], texcoord[2];
 };
 
+/*
+ * All groups and LODs of a model share one vertex and one index buffer.
+ * The material colour is per vertex, so the visible groups are drawn with
+ * a single call.
+ */
 class Model {
 public:
+	static const int MAX_LOD = 4;
+
+	/* Range of the index buffer */
+	struct ModelLOD {
+		size_t first, count;
+	};
+
 	struct ModelGroup {
 		Color diffuse;
-		size_t count;
-		GLuint buffer;
+		AABB box;
+		int num_lods;
+		ModelLOD lods[MAX_LOD];
 	};
 
 	bool empty() const { return m_groups.empty(); }
+	const AABB &bounds() const { return m_bounds; }
 
 	Model();
 	~Model();
 	void load(const char *fname, double scale=1,
 		  const vec3 &origo=vec3(0, 0, 0));
-	void draw(bool noise);
+	/* Draws nothing until the loader threads are done with it */
+	void load_async(const char *fname, double scale=1,
+			const vec3 &origo=vec3(0, 0, 0));
+	bool loading() const { return m_job != NULL; }
+	/* Of the buffers, zero while loading */
+	size_t gpu_bytes() const { return m_gpu_bytes; }
+	/* Textured with the noise texture, if one is given */
+	void draw(GLuint noise=INVALID_TEXTURE);
 
 private:
+	struct Staging;
+	class Job;
+	friend class Job;
+
 	std::list<ModelGroup> m_groups;
+	AABB m_bounds;
+	GLuint m_vertex_buffer, m_index_buffer;
+	bool m_quantized;
+	vec3 m_decode_offset;
+	double m_decode_scale;
+	GLenum m_index_type;
+	size_t m_index_size;
+	size_t m_gpu_bytes;
+	std::vector<GLsizei> m_counts;
+	std::vector<const GLvoid *> m_offsets;
+	Job *m_job;
+
+	void clear();
+	void cancel_load();
+	static void build(Staging *staging, const char *fname, double scale,
+			  const vec3 &origo);
+	void upload(Staging *staging, const char *fname);
 
 	DISABLE_COPY_AND_ASSIGN(Model);
 };
@@ -127,26 +197,69 @@ private:
 struct FBO {
 	GLuint fbo;
 	GLuint texture;
+	GLuint depthbuffer;
 };
 
+/*
+ * Glyphs are kept as signed distance fields, so one atlas draws any size
+ * sharply. Laid out strings are kept in VBOs keyed by the text and scale,
+ * so text that stays the same costs one draw call. The least recently drawn
+ * one is dropped when the cache is full.
+ */
 class GLFont {
 public:
+	static const size_t MAX_CACHED_TEXTS = 64;
+
 	GLFont();
 	~GLFont();
 
+	/* Size in points at scale 1 */
 	void open(const char *fname, int size);
+	/* Rasterized on a loader thread, not to be drawn until finished */
+	void open_async(const char *fname, int size);
+	/* The atlas open() uses, for the cache and the archive */
+	std::string bake(const char *fname);
 
 	void draw_text(const vec2 &pos, const std::string &s, double scale=1) const;
 
 private:
 	static const size_t NUM_GLYPHS = 256;
 
+	class OpenJob;
+	friend class OpenJob;
+
 	struct Glyph {
 		vec2 tex_pos, tex_size, size;
 		vec2 offset, advance;
 	};
+	typedef std::pair<std::string, double> text_key_t;
+
+	struct TextMesh {
+		GLuint buffer;
+		size_t count;
+		std::list<text_key_t>::iterator lru;
+	};
+
+	typedef std::map<text_key_t, TextMesh> text_map_t;
+
 	GLuint m_texture;
+	GLuint m_program;
+	double m_scale;
 	Glyph m_glyphs[NUM_GLYPHS];
+	mutable text_map_t m_texts;
+	/* most recently drawn first */
+	mutable std::list<text_key_t> m_lru;
+
+	void rasterize(const std::string &font, Image *atlas);
+	const char *parse_atlas(const char *data, size_t size, int *width,
+				int *height);
+	std::string cached_atlas(const char *fname);
+	void read_atlas(const char *fname, std::string *cached,
+			const char **data, size_t *data_size);
+	void upload_atlas(const char *fname, const char *data,
+			  size_t data_size, int size);
+	const TextMesh *cached_text(const std::string &s, double scale) const;
+	void clear_texts();
 
 	DISABLE_COPY_AND_ASSIGN(GLFont);
 };
@@ -166,12 +279,30 @@ extern inline void glColor(const Color &c)
 	glColor4f(c.r, c.g, c.b, c.a);
 }
 
+void load_image(Image *image, const char *fname);
+GLuint upload_texture(const Image *image);
+/* Decoded once, then uploaded level by level from data/cache */
 GLuint load_png(const char *fname);
+/*
+ * A placeholder until the loader threads are done with it, the size of
+ * the texture is stored then.
+ */
+void load_png_async(GLuint *texture, const char *fname, size_t *bytes=NULL);
+/* Decoded, with every mip level, for the archive */
+void pack_image(const char *fname, std::string *out);
 void load_mesh(Mesh *mesh, const char *fname, double scale=1,
 	       const vec3 &origo=vec3(0, 0, 0));
+void pack_mesh(const char *fname, std::string *out);
 void draw_quad(const vec2 &pos, const vec2 &size);
 void draw_block(const Plane *walls, size_t num_walls);
-void create_fbo(FBO *fbo, int width, int height, bool bilinear);
-GLuint load_program(const char *vs_source, const char *fs_source);
+void create_fbo(FBO *fbo, int width, int height, bool bilinear,
+		GLenum format=GL_RGB, bool depth=true);
+void delete_fbo(FBO *fbo);
+void extract_frustum(Frustum *frustum, const GLdouble *proj, const GLdouble *mdl);
+bool box_visible(const Frustum *frustum, const AABB &box);
+GLuint load_program(const char *vs_source, const char *fs_source,
+		    const char *attrib0=NULL);
+GLuint load_feedback_program(const char *vs_source, const char **varyings,
+			     int num_varyings, const char *attrib0=NULL);
 
 #endif
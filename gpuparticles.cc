@@ -0,0 +1,318 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Particles simulated with transform feedback
+ */
+#include "gpuparticles.h"
+#include "particles.h"
+#include "utils.h"
+
+namespace {
+
+/* Same drift and random kicks as update_particles() */
+const char *update_vs =
+"#version 130\n\
+in vec4 pos_time;\
+in vec4 vel_duration;\
+in vec4 color;\
+in float size;\
+out vec4 out_pos_time;\
+out vec4 out_vel_duration;\
+out vec4 out_color;\
+out float out_size;\
+uniform float dt;\
+uniform uint seed;\
+uniform uint first;\
+float random(inout uint state)\
+{\
+	state = state * 747796405u + 2891336453u;\
+	uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;\
+	return float((word >> 22u) ^ word) / 4294967296.0;\
+}\
+void main(void)\
+{\
+	vec3 pos = pos_time.xyz;\
+	vec3 vel = vel_duration.xyz;\
+	float time = pos_time.w;\
+	if (time <= vel_duration.w) {\
+		uint state = (uint(gl_VertexID) + first) * 1664525u + seed;\
+		pos += vel * dt;\
+		vel = vel * (1.0 - 0.1 * dt) + vec3(0.0, dt, 0.0);\
+		if (random(state) < dt) {\
+			vec3 kick = vec3(random(state), random(state),\
+					 random(state));\
+			vel += (kick - vec3(0.5)) * dt;\
+		}\
+		time += dt;\
+	}\
+	out_pos_time = vec4(pos, time);\
+	out_vel_duration = vec4(vel, vel_duration.w);\
+	out_color = color;\
+	out_size = size;\
+}";
+
+const char *varyings[] = {
+	"out_pos_time", "out_vel_duration", "out_color", "out_size",
+};
+
+/* Grows and fades like draw_smoke(), dead particles collapse to a point */
+const char *draw_vs =
+"attribute vec2 corner;\
+attribute vec4 pos_time;\
+attribute vec4 vel_duration;\
+attribute vec4 color;\
+attribute float size;\
+varying vec2 tc;\
+varying vec4 col;\
+void main(void)\
+{\
+	float age = pos_time.w / vel_duration.w;\
+	float s = age <= 1.0 ? age * size : 0.0;\
+	vec4 eye = gl_ModelViewMatrix * vec4(pos_time.xyz, 1.0);\
+	eye.xy += corner * s;\
+	gl_Position = gl_ProjectionMatrix * eye;\
+	tc = corner * 0.5 + vec2(0.5);\
+	col = vec4(color.rgb, color.a * (1.0 - age));\
+}";
+
+const char *draw_fs =
+"uniform sampler2D tex;\
+varying vec2 tc;\
+varying vec4 col;\
+void main(void)\
+{\
+	gl_FragColor = vec4(col.rgb, col.a * texture2D(tex, tc).a);\
+}";
+
+}
+
+GPUParticles::GPUParticles() :
+	m_current(0),
+	m_head(0),
+	m_used(0),
+	m_time(0),
+	m_update_program(0),
+	m_draw_program(0),
+	m_corners(0)
+{
+	m_buffers[0] = 0;
+	m_buffers[1] = 0;
+}
+
+GPUParticles::~GPUParticles()
+{
+	if (m_update_program) {
+		glDeleteBuffers(2, m_buffers);
+		glDeleteBuffers(1, &m_corners);
+		glDeleteProgram(m_update_program);
+		glDeleteProgram(m_draw_program);
+	}
+}
+
+void GPUParticles::init()
+{
+	m_update_program = load_feedback_program(update_vs, varyings,
+						 ARRAY_SIZE(varyings),
+						 "pos_time");
+	m_draw_program = load_program(draw_vs, draw_fs, "corner");
+
+	glGenBuffers(2, m_buffers);
+	for (int i = 0; i < 2; ++i) {
+		glBindBuffer(GL_ARRAY_BUFFER, m_buffers[i]);
+		glBufferData(GL_ARRAY_BUFFER, sizeof(Particle) * GPU_PARTICLES,
+			     NULL, GL_DYNAMIC_COPY);
+	}
+
+	const float quad[] = {-1, -1, 1, -1, 1, 1, -1, 1};
+	glGenBuffers(1, &m_corners);
+	glBindBuffer(GL_ARRAY_BUFFER, m_corners);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void GPUParticles::bind_state(GLuint program, GLuint buffer, size_t first,
+			      bool instanced)
+{
+	const char *names[] = {"pos_time", "vel_duration", "color", "size"};
+	const int sizes[] = {4, 4, 4, 1};
+	const Particle *p = (const Particle *) NULL + first;
+	const float *offsets[] = {p->pos_time, p->vel_duration, p->color,
+				  &p->size};
+
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	for (int i = 0; i < 4; ++i) {
+		GLint attr = glGetAttribLocation(program, names[i]);
+		glVertexAttribPointer(attr, sizes[i], GL_FLOAT, GL_FALSE,
+				      sizeof(Particle), offsets[i]);
+		glEnableVertexAttribArray(attr);
+		if (instanced) {
+			glVertexAttribDivisorARB(attr, 1);
+		}
+	}
+}
+
+void GPUParticles::unbind_state(GLuint program)
+{
+	const char *names[] = {"pos_time", "vel_duration", "color", "size"};
+	for (int i = 0; i < 4; ++i) {
+		GLint attr = glGetAttribLocation(program, names[i]);
+		glVertexAttribDivisorARB(attr, 0);
+		glDisableVertexAttribArray(attr);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void GPUParticles::append(ParticlePool *pool)
+{
+	if (pool->count == 0)
+		return;
+	if (m_update_program == 0) {
+		init();
+	}
+
+	m_staging.resize(pool->count);
+	double lifetime = 0;
+	for (size_t i = 0; i < pool->count; ++i) {
+		lifetime = std::max(lifetime,
+				    double(pool->duration[i] - pool->time[i]));
+		Particle *p = &m_staging[i];
+		p->pos_time[0] = pool->x[i];
+		p->pos_time[1] = pool->y[i];
+		p->pos_time[2] = pool->z[i];
+		p->pos_time[3] = pool->time[i];
+		p->vel_duration[0] = pool->vx[i];
+		p->vel_duration[1] = pool->vy[i];
+		p->vel_duration[2] = pool->vz[i];
+		p->vel_duration[3] = pool->duration[i];
+		p->color[0] = pool->r[i];
+		p->color[1] = pool->g[i];
+		p->color[2] = pool->b[i];
+		p->color[3] = pool->a[i];
+		p->size = pool->size[i];
+	}
+	pool->count = 0;
+
+	/* write at the head, in two pieces if the ring wraps */
+	glBindBuffer(GL_ARRAY_BUFFER, m_buffers[m_current]);
+	size_t done = 0;
+	while (done < m_staging.size()) {
+		size_t n = std::min(m_staging.size() - done,
+				    GPU_PARTICLES - m_head);
+		glBufferSubData(GL_ARRAY_BUFFER, sizeof(Particle) * m_head,
+				sizeof(Particle) * n, &m_staging[done]);
+		done += n;
+		m_head = (m_head + n) % GPU_PARTICLES;
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	Batch batch;
+	batch.count = m_staging.size();
+	batch.expires = m_time + lifetime;
+	m_batches.push_back(batch);
+	m_used += batch.count;
+
+	/* the oldest batches were overwritten if the ring wrapped over them */
+	while (m_used > GPU_PARTICLES) {
+		Batch *oldest = &m_batches.front();
+		size_t n = std::min(oldest->count, m_used - GPU_PARTICLES);
+		oldest->count -= n;
+		m_used -= n;
+		if (oldest->count == 0) {
+			m_batches.pop_front();
+		}
+	}
+}
+
+/* The live range, in two pieces if it wraps around the end of the ring */
+int GPUParticles::live_range(size_t *first, size_t *count)
+{
+	if (m_used == 0)
+		return 0;
+	first[0] = (m_head + GPU_PARTICLES - m_used) % GPU_PARTICLES;
+	count[0] = std::min(m_used, GPU_PARTICLES - first[0]);
+	if (count[0] == m_used)
+		return 1;
+	first[1] = 0;
+	count[1] = m_used - count[0];
+	return 2;
+}
+
+void GPUParticles::update(double dt)
+{
+	m_time += dt;
+	while (!m_batches.empty() && m_batches.front().expires < m_time) {
+		m_used -= m_batches.front().count;
+		m_batches.pop_front();
+	}
+
+	size_t first[2], count[2];
+	int pieces = live_range(first, count);
+	if (pieces == 0)
+		return;
+
+	glUseProgram(m_update_program);
+	glUniform1f(glGetUniformLocation(m_update_program, "dt"), dt);
+	glUniform1ui(glGetUniformLocation(m_update_program, "seed"),
+		     GLuint(uniform() * 4294967295.0));
+
+	/* particles keep their slots, so the feedback goes to the same range */
+	GLint first_uniform = glGetUniformLocation(m_update_program, "first");
+	glEnable(GL_RASTERIZER_DISCARD);
+	for (int i = 0; i < pieces; ++i) {
+		/* gl_VertexID restarts at zero for each piece */
+		glUniform1ui(first_uniform, first[i]);
+		bind_state(m_update_program, m_buffers[m_current], first[i],
+			   false);
+		glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0,
+				  m_buffers[1 - m_current],
+				  sizeof(Particle) * first[i],
+				  sizeof(Particle) * count[i]);
+		glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, count[i]);
+		glEndTransformFeedback();
+	}
+	glDisable(GL_RASTERIZER_DISCARD);
+
+	glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+	unbind_state(m_update_program);
+	glUseProgram(0);
+	m_current = 1 - m_current;
+}
+
+void GPUParticles::draw()
+{
+	size_t first[2], count[2];
+	int pieces = live_range(first, count);
+	if (pieces == 0)
+		return;
+
+	glUseProgram(m_draw_program);
+
+	GLint corner_attr = glGetAttribLocation(m_draw_program, "corner");
+	glBindBuffer(GL_ARRAY_BUFFER, m_corners);
+	glVertexAttribPointer(corner_attr, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	glEnableVertexAttribArray(corner_attr);
+
+	for (int i = 0; i < pieces; ++i) {
+		bind_state(m_draw_program, m_buffers[m_current], first[i],
+			   true);
+		glDrawArraysInstancedARB(GL_TRIANGLE_FAN, 0, 4, count[i]);
+	}
+	unbind_state(m_draw_program);
+
+	glDisableVertexAttribArray(corner_attr);
+	glUseProgram(0);
+}
+
+void GPUParticles::clear()
+{
+	m_head = 0;
+	m_used = 0;
+	m_batches.clear();
+}
@@ -0,0 +1,62 @@
+#ifndef __gpuparticles_h
+#define __gpuparticles_h
+
+#include "gl.h"
+#include <deque>
+
+struct ParticlePool;
+
+/* Ring size, the oldest particles are overwritten when it wraps */
+const size_t GPU_PARTICLES = 262144;
+
+/*
+ * Particles that live in buffer objects and are stepped with transform
+ * feedback, ping-ponging between two buffers. New particles are collected
+ * on the CPU and appended at the head of the ring. Only the live part of
+ * the ring, from the oldest batch that has not expired to the head, is
+ * simulated and drawn. Needs OpenGL 3.0 and instanced arrays.
+ */
+class GPUParticles {
+public:
+	GPUParticles();
+	~GPUParticles();
+
+	/* Moves the particles of the pool to the GPU and empties it */
+	void append(ParticlePool *pool);
+	void update(double dt);
+	/* Blending and the texture are set up by the caller */
+	void draw();
+	void clear();
+
+private:
+	struct Particle {
+		float pos_time[4];
+		float vel_duration[4];
+		float color[4];
+		float size;
+	};
+
+	/* Particles appended together, dead once m_time passes expires */
+	struct Batch {
+		size_t count;
+		double expires;
+	};
+
+	GLuint m_buffers[2];
+	int m_current;
+	size_t m_head, m_used;
+	double m_time;
+	std::deque<Batch> m_batches;
+	GLuint m_update_program, m_draw_program, m_corners;
+	std::vector<Particle> m_staging;
+
+	void init();
+	void bind_state(GLuint program, GLuint buffer, size_t first,
+			bool instanced);
+	void unbind_state(GLuint program);
+	int live_range(size_t *first, size_t *count);
+
+	DISABLE_COPY_AND_ASSIGN(GPUParticles);
+};
+
+#endif
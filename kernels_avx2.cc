@@ -0,0 +1,26 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Kernels for AVX2, built with -mavx2
+ */
+#include "cpu.h"
+#include <algorithm>
+#include <math.h>
+#include <immintrin.h>
+
+namespace avx2 {
+#include "simd.h"
+#include "kernels.inc"
+}
+
+const Kernels kernels_avx2 = {
+	avx2::integrate,
+	avx2::skin,
+	avx2::mix_audio,
+};
@@ -0,0 +1,26 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Kernels for AVX-512, built with -mavx512f -mavx512bw
+ */
+#include "cpu.h"
+#include <algorithm>
+#include <math.h>
+#include <immintrin.h>
+
+namespace avx512 {
+#include "simd.h"
+#include "kernels.inc"
+}
+
+const Kernels kernels_avx512 = {
+	avx512::integrate,
+	avx512::skin,
+	avx512::mix_audio,
+};
@@ -0,0 +1,30 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Kernels for plain C++, also where the compiler would assume SSE2
+ */
+#include "cpu.h"
+#include <algorithm>
+#include <math.h>
+
+#undef __SSE2__
+#undef __AVX2__
+#undef __AVX512F__
+#undef __AVX512BW__
+
+namespace generic {
+#include "simd.h"
+#include "kernels.inc"
+}
+
+const Kernels kernels_generic = {
+	generic::integrate,
+	generic::skin,
+	generic::mix_audio,
+};
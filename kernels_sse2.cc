@@ -0,0 +1,26 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Kernels for SSE2, built with -msse2
+ */
+#include "cpu.h"
+#include <algorithm>
+#include <math.h>
+#include <emmintrin.h>
+
+namespace sse2 {
+#include "simd.h"
+#include "kernels.inc"
+}
+
+const Kernels kernels_sse2 = {
+	sse2::integrate,
+	sse2::skin,
+	sse2::mix_audio,
+};
@@ -0,0 +1,193 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Background loading
+ */
+#include "loader.h"
+#include "cpu.h"
+#include <SDL.h>
+#include <algorithm>
+#include <stdexcept>
+#include <list>
+#include <vector>
+
+namespace {
+
+const int MAX_LOADER_THREADS = 4;
+/* Loaded jobs waiting for the main thread, bounds the memory use */
+const size_t MAX_LOADED = 8;
+/* Milliseconds of each frame spent in finish() */
+const Uint32 FINISH_BUDGET = 4;
+
+struct Pending {
+	LoadJob *job;
+	/* in queue order, picks the random stream of the job */
+	unsigned id;
+	std::string error;
+};
+
+SDL_mutex *mutex = NULL;
+/* work_cond: something to load, done_cond: something to finish */
+SDL_cond *work_cond = NULL, *done_cond = NULL;
+std::list<Pending> queued, loaded;
+std::vector<SDL_Thread *> threads;
+int running = 0;
+unsigned next_id = 0;
+__thread bool is_loader_thread = false;
+bool quit = false;
+
+int loader_thread(void *)
+{
+	is_loader_thread = true;
+
+	SDL_LockMutex(mutex);
+	while (1) {
+		while (!quit && (queued.empty() || loaded.size() >= MAX_LOADED))
+			SDL_CondWait(work_cond, mutex);
+		if (quit)
+			break;
+		Pending p = queued.front();
+		queued.pop_front();
+		running++;
+		SDL_UnlockMutex(mutex);
+
+		seed_thread_random(LOADER_RANDOM_STREAM + p.id);
+		try {
+			p.job->load();
+		} catch (const std::exception &e) {
+			p.error = e.what();
+		}
+
+		SDL_LockMutex(mutex);
+		running--;
+		loaded.push_back(p);
+		SDL_CondBroadcast(done_cond);
+	}
+	SDL_UnlockMutex(mutex);
+	return 0;
+}
+
+void start_threads()
+{
+	mutex = SDL_CreateMutex();
+	work_cond = SDL_CreateCond();
+	done_cond = SDL_CreateCond();
+	quit = false;
+	/* the main thread keeps a core */
+	int count = std::max(std::min(num_cpus() - 1, MAX_LOADER_THREADS), 1);
+	for (int i = 0; i < count; ++i) {
+		SDL_Thread *thread = SDL_CreateThread(loader_thread, NULL);
+		if (thread == NULL) {
+			throw std::runtime_error(strf("Can not create a thread: %s",
+						      SDL_GetError()));
+		}
+		threads.push_back(thread);
+	}
+	debug("%d loader threads\n", count);
+}
+
+/* False if there was nothing to finish */
+bool finish_one(bool wait)
+{
+	SDL_LockMutex(mutex);
+	while (wait && loaded.empty() && (!queued.empty() || running > 0))
+		SDL_CondWait(done_cond, mutex);
+	if (loaded.empty()) {
+		SDL_UnlockMutex(mutex);
+		return false;
+	}
+	Pending p = loaded.front();
+	loaded.pop_front();
+	SDL_CondBroadcast(work_cond);
+	SDL_UnlockMutex(mutex);
+
+	try {
+		if (!p.error.empty()) {
+			throw std::runtime_error(p.error);
+		}
+		if (!p.job->cancelled()) {
+			p.job->finish();
+		}
+	} catch (...) {
+		delete p.job;
+		throw;
+	}
+	delete p.job;
+	return true;
+}
+
+}
+
+void start_load(LoadJob *job)
+{
+	if (threads.empty()) {
+		start_threads();
+	}
+	Pending p;
+	p.job = job;
+	SDL_LockMutex(mutex);
+	p.id = next_id++;
+	queued.push_back(p);
+	SDL_CondSignal(work_cond);
+	SDL_UnlockMutex(mutex);
+}
+
+void finish_loads()
+{
+	if (threads.empty())
+		return;
+	Uint32 start = SDL_GetTicks();
+	while (SDL_GetTicks() - start < FINISH_BUDGET && finish_one(false)) {
+	}
+}
+
+bool finish_load()
+{
+	if (threads.empty())
+		return false;
+	return finish_one(true);
+}
+
+void finish_all_loads()
+{
+	while (finish_load()) {
+	}
+}
+
+/* Jobs that were not finished yet are dropped */
+void stop_loader()
+{
+	if (threads.empty())
+		return;
+	SDL_LockMutex(mutex);
+	quit = true;
+	SDL_CondBroadcast(work_cond);
+	SDL_UnlockMutex(mutex);
+	FOR_EACH(std::vector<SDL_Thread *>, thread, threads) {
+		SDL_WaitThread(*thread, NULL);
+	}
+	threads.clear();
+
+	FOR_EACH(std::list<Pending>, p, queued) {
+		delete p->job;
+	}
+	FOR_EACH(std::list<Pending>, p, loaded) {
+		delete p->job;
+	}
+	queued.clear();
+	loaded.clear();
+	SDL_DestroyCond(work_cond);
+	SDL_DestroyCond(done_cond);
+	SDL_DestroyMutex(mutex);
+}
+
+bool on_loader_thread()
+{
+	return is_loader_thread;
+}
@@ -0,0 +1,40 @@
+#ifndef __loader_h
+#define __loader_h
+
+#include "utils.h"
+
+/*
+ * Loading in two halves: load() reads and decodes on a loader thread,
+ * then finish() makes the GL objects on the main thread.
+ */
+class LoadJob {
+public:
+	LoadJob() : m_cancelled(false) {}
+	virtual ~LoadJob() {}
+
+	virtual void load() = 0;
+	virtual void finish() = 0;
+
+	/* Only from the main thread, finish() is then skipped */
+	void cancel() { m_cancelled = true; }
+	bool cancelled() const { return m_cancelled; }
+
+private:
+	bool m_cancelled;
+
+	DISABLE_COPY_AND_ASSIGN(LoadJob);
+};
+
+/* Takes the ownership, the threads are started on the first call */
+void start_load(LoadJob *job);
+/* Once per frame, finishes loaded jobs for a few milliseconds */
+void finish_loads();
+/* Waits for one job and finishes it, false if nothing is left */
+bool finish_load();
+/* Waits for everything that was started */
+void finish_all_loads();
+void stop_loader();
+/* True on a loader thread, those already keep the cores busy */
+bool on_loader_thread();
+
+#endif
@@ -12,8 +12,14 @@
 #include "sound.h"
 #include "system.h"
 #include "menu.h"
+#include "effects.h"
+#include "cpu.h"
+#include "archive.h"
+#include "loader.h"
+#include "resources.h"
 #include <SDL.h>
 #include <stdexcept>
+#include <stdlib.h>
 #include <unistd.h>
 #include <fenv.h>
 #include <time.h>
@@ -26,32 +32,95 @@ GLFont vera;
 
 int main(int argc, char **argv)
 try {
+	startup_trace("start");
+	uint64_t seed = time(NULL);
+	CPULevel cpu = detect_cpu();
+	bool selftest = false, bench = false;
+	bool pack = false, use_archive = true;
+	int window_w = 1024, window_h = 768;
 	for (int i = 1; i < argc; ++i) {
 		std::string arg = argv[i];
 		if (arg == "-window") {
 			fullscreen = false;
+		} else if (arg.substr(0, 6) == "-size=") {
+			if (sscanf(arg.c_str() + 6, "%dx%d", &window_w,
+				   &window_h) != 2) {
+				throw std::runtime_error(strf("Bad size: %s",
+							      arg.c_str()));
+			}
 		} else if (arg == "-debug") {
 			debug_enabled = true;
+		} else if (arg.substr(0, 7) == "-bloom=") {
+			bloom_quality = atoi(arg.c_str() + 7);
+		} else if (arg.substr(0, 13) == "-particleres=") {
+			particle_scale = std::max(atoi(arg.c_str() + 13), 1);
+		} else if (arg.substr(0, 6) == "-seed=") {
+			seed = strtoull(arg.c_str() + 6, NULL, 10);
+		} else if (arg.substr(0, 5) == "-cpu=") {
+			cpu = parse_cpu_level(arg.c_str() + 5);
+		} else if (arg == "-selftest") {
+			selftest = true;
+		} else if (arg == "-bench") {
+			bench = true;
+		} else if (arg == "-gpuparticles") {
+			gpu_particles = true;
+		} else if (arg == "-noquantize") {
+			quantize_models = false;
+		} else if (arg.substr(0, 8) == "-gpumem=") {
+			gpu_budget = size_t(atoi(arg.c_str() + 8)) << 20;
+		} else if (arg.substr(0, 8) == "-cpumem=") {
+			cpu_budget = size_t(atoi(arg.c_str() + 8)) << 20;
+		} else if (arg == "-nocompress") {
+			compress_textures = false;
+		} else if (arg == "-pack") {
+			pack = true;
+		} else if (arg == "-nopack") {
+			use_archive = false;
 		} else {
 			printf("Uknown argument: %s\n", argv[i]);
 		}
 	}
 
-	srand(time(NULL));
+	seed_random(seed);
+
+	if (selftest) {
+		return kernel_selftest() ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if (bench) {
+		kernel_benchmark();
+		return EXIT_SUCCESS;
+	}
+	init_kernels(cpu);
+
+	chdir("data");
+
+	if (pack) {
+		build_archive("seko.pak");
+		return EXIT_SUCCESS;
+	}
+	if (use_archive) {
+		open_archive("seko.pak");
+	}
+	startup_trace("archive");
+
+	/* decoded on the loader threads while the window comes up */
+	vera.open_async("Vera.ttf", 16);
+	preload_menu();
 
 	if (SDL_Init(SDL_INIT_VIDEO|SDL_INIT_AUDIO)) {
 		throw std::runtime_error(strf("Can not initialize SDL: %s",
 					      SDL_GetError()));
 	}
-	open_window(1024, 768);
+	startup_trace("SDL");
+	open_window(window_w, window_h);
+	startup_trace("window");
 
 	glewInit();
 
 	if (!GLEW_VERSION_1_5) {
 		throw std::runtime_error("OpenGL 1.5 required!");
 	}
-
-	chdir("data");
+	startup_trace("GLEW");
 
 #ifdef __linux__
 	std::string opengl_vendor = (char *) glGetString(GL_VENDOR);
@@ -69,13 +138,17 @@ try {
 	glMaterialfv(GL_FRONT_AND_BACK, GL_AMBIENT, black);
 
 	init_sound();
+	startup_trace("audio");
 
-	vera.open("Vera.ttf", 16);
+	finish_all_loads();
+	startup_trace("assets");
 
 	menu();
+	stop_loader();
 	return 0;
 
 } catch (const std::runtime_error &e) {
+	stop_loader();
 	SDL_Quit();
 #ifdef _WIN32
 	MessageBox(NULL, e.what(), "Error", MB_OK|MB_ICONERROR);
@@ -0,0 +1,94 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Memory mapped files
+ */
+#include "mapfile.h"
+#include <stdexcept>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const char *fname) :
+	m_data(NULL), m_size(0), m_mapping(NULL)
+{
+	HANDLE file = CreateFile(fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+				 OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error(strf("Can not open %s", fname));
+	}
+	m_size = GetFileSize(file, NULL);
+	if (m_size > 0) {
+		m_mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0,
+					      NULL);
+		if (m_mapping != NULL) {
+			m_data = (const char *) MapViewOfFile(m_mapping,
+						FILE_MAP_READ, 0, 0, 0);
+		}
+	}
+	CloseHandle(file);
+	if (m_size > 0 && m_data == NULL) {
+		if (m_mapping != NULL) {
+			CloseHandle(m_mapping);
+		}
+		throw std::runtime_error(strf("Can not map %s", fname));
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_data != NULL) {
+		UnmapViewOfFile(m_data);
+		CloseHandle(m_mapping);
+	}
+}
+
+#else
+
+MappedFile::MappedFile(const char *fname) :
+	m_data(NULL), m_size(0), m_mapping(NULL)
+{
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(strf("Can not open %s", fname));
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		throw std::runtime_error(strf("Can not stat %s", fname));
+	}
+	m_size = st.st_size;
+	if (m_size > 0) {
+		/* the mapping stays valid after closing */
+		void *p = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) {
+			close(fd);
+			throw std::runtime_error(strf("Can not map %s", fname));
+		}
+		m_data = (const char *) p;
+		m_mapping = p;
+	}
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_mapping != NULL) {
+		munmap(m_mapping, m_size);
+	}
+}
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef __mapfile_h
+#define __mapfile_h
+
+#include "utils.h"
+
+/* Read-only view of a whole file */
+class MappedFile {
+public:
+	MappedFile(const char *fname);
+	~MappedFile();
+
+	const char *data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	const char *m_data;
+	size_t m_size;
+	void *m_mapping;
+
+	DISABLE_COPY_AND_ASSIGN(MappedFile);
+};
+
+#endif
@@ -13,10 +13,13 @@
 #include "gl.h"
 #include "stage.h"
 #include "effects.h"
+#include "sprites.h"
 #include "skeleton.h"
 #include "sound.h"
 #include "game.h"
 #include "system.h"
+#include "loader.h"
+#include "resources.h"
 #include <SDL.h>
 #include <stdexcept>
 #include <sstream>
@@ -42,6 +45,22 @@ const Color white(1, 1, 1);
 
 Skeleton dancer;
 
+/* Writes the skeleton on the loader thread, wait before touching it */
+class SkeletonJob : public LoadJob {
+public:
+	SkeletonJob(Skeleton *skeleton, const char *fname, const vec3 &origo) :
+		m_skeleton(skeleton), m_fname(fname), m_origo(origo)
+	{}
+
+	void load() { load_skeleton(m_skeleton, m_fname.c_str(), m_origo); }
+	void finish() {}
+
+private:
+	Skeleton *m_skeleton;
+	std::string m_fname;
+	vec3 m_origo;
+};
+
 struct Highscore {
 	int score;
 	std::string name;
@@ -166,12 +185,6 @@ void submit_highscore()
 
 void draw_highscores()
 {
-	static GLuint logo = INVALID_TEXTURE, text;
-	if (logo == INVALID_TEXTURE) {
-		logo = load_png("logo.png");
-		text = load_png("highscores.png");
-	}
-
 	glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 
 	glMatrixMode(GL_PROJECTION);
@@ -180,21 +193,11 @@ void draw_highscores()
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
-	{
-		GLState state;
-		state.enable(GL_TEXTURE_2D);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		state.enable(GL_BLEND);
-
-		glColor(white);
-		vec2 pos(screen->w/2 - 256, 50);
-		glBindTexture(GL_TEXTURE_2D, logo);
-		draw_quad(pos, vec2(512, 256));
-
-		pos = vec2(screen->w/2 - 256, screen->h/2 - 100);
-		glBindTexture(GL_TEXTURE_2D, text);
-		draw_quad(pos, vec2(512, 64));
-	}
+	sprite_batch.draw(get_sprite("logo.png"), vec2(screen->w/2 - 256, 50),
+			  vec2(512, 256), white);
+	sprite_batch.draw(get_sprite("highscores.png"),
+			  vec2(screen->w/2 - 256, screen->h/2 - 100),
+			  vec2(512, 64), white);
 
 	Color active(1, 1, 0);
 
@@ -208,7 +211,8 @@ void draw_highscores()
 	FOR_EACH_CONST(std::list<Highscore>, hs, highscores) {
 		if (enter_name && score >= hs->score && !enter_drawn) {
 			glColor(active);
-			draw_number(vec2(screen->w/2 - DIGIT_WIDTH*8, y), score, 8);
+			draw_number(vec2(screen->w/2 - DIGIT_WIDTH*8, y), score, 8,
+				    active);
 			vera.draw_text(vec2(screen->w/2 + 10, y + 40), name_buffer + "_");
 			y += DIGIT_HEIGHT + 10;
 			enter_drawn = true;
@@ -221,17 +225,18 @@ void draw_highscores()
 
 	if (enter_name && !enter_drawn) {
 		glColor(active);
-		draw_number(vec2(screen->w/2 - DIGIT_WIDTH*8, y), score, 8);
+		draw_number(vec2(screen->w/2 - DIGIT_WIDTH*8, y), score, 8,
+			    active);
 		vera.draw_text(vec2(screen->w/2 + 10, y + 40), name_buffer + "_");
 	}
+
+	sprite_batch.flush();
 }
 
 void highscores_menu()
 {
-	static Sound awwyeah;
-	if (awwyeah.data.empty()) {
-		load_sound(&awwyeah, "awwyeah.ogg");
-	}
+	/* cached, but evictable once the menu is left */
+	SoundHandle awwyeah = get_sound("awwyeah.ogg");
 	bool quit = false;
 	enter_name = false;
 	name_buffer.clear();
@@ -249,7 +254,7 @@ void highscores_menu()
 	}
 
 	if (enter_name) {
-		play_sound(&awwyeah);
+		play_sound(awwyeah.get());
 		SDL_EnableUNICODE(1);
 	}
 
@@ -293,6 +298,7 @@ void highscores_menu()
 		draw_highscores();
 
 		SDL_GL_SwapBuffers();
+		finish_loads();
 		SDL_Delay(5);
 		check_gl_errors();
 	}
@@ -301,13 +307,6 @@ void highscores_menu()
 
 void draw_intermission()
 {
-	static GLuint logo = INVALID_TEXTURE, score_tex, nextlevel;
-	if (logo == INVALID_TEXTURE) {
-		logo = load_png("logo.png");
-		score_tex = load_png("score.png");
-		nextlevel = load_png("nextlevel.png");
-	}
-
 	glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 
 	glMatrixMode(GL_PROJECTION);
@@ -316,29 +315,18 @@ void draw_intermission()
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
-	{
-		GLState state;
-		state.enable(GL_TEXTURE_2D);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-		state.enable(GL_BLEND);
-
-		glColor(white);
-		vec2 pos(screen->w/2 - 256, 50);
-		glBindTexture(GL_TEXTURE_2D, logo);
-		draw_quad(pos, vec2(512, 256));
-
-		pos = vec2(screen->w/2 - 256, screen->h/2 - 64);
-		glBindTexture(GL_TEXTURE_2D, score_tex);
-		draw_quad(pos, vec2(512, 64));
-
-		if (level->name != NULL) {
-			pos = vec2(screen->w/2 - 256, screen->h/2 + 100);
-			glBindTexture(GL_TEXTURE_2D, nextlevel);
-			draw_quad(pos, vec2(512, 64));
-		}
+	sprite_batch.draw(get_sprite("logo.png"), vec2(screen->w/2 - 256, 50),
+			  vec2(512, 256), white);
+	sprite_batch.draw(get_sprite("score.png"),
+			  vec2(screen->w/2 - 256, screen->h/2 - 64),
+			  vec2(512, 64), white);
+	if (level->name != NULL) {
+		sprite_batch.draw(get_sprite("nextlevel.png"),
+				  vec2(screen->w/2 - 256, screen->h/2 + 100),
+				  vec2(512, 64), white);
 	}
-
 	draw_number(vec2(screen->w/2 - DIGIT_WIDTH*4, screen->h/2), score, 8);
+	sprite_batch.flush();
 
 	if (level->name != NULL) {
 		Color inactive(0.5, 0.8, 1);
@@ -379,6 +367,7 @@ void intermission_menu()
 		draw_intermission();
 
 		SDL_GL_SwapBuffers();
+		finish_loads();
 		SDL_Delay(5);
 		check_gl_errors();
 	}
@@ -488,26 +477,10 @@ void draw_scene()
 
 void draw_menu()
 {
-	static GLuint logo = INVALID_TEXTURE, help;
-	static GLuint menu_pics[MAX_MENU];
-	if (logo == INVALID_TEXTURE) {
-		logo = load_png("logo.png");
-		help = load_png("help.png");
-		for (int i = 0; i < MAX_MENU; ++i) {
-			menu_pics[i] = load_png(menu_picnames[i]);
-		}
-	}
-
 	if (GLEW_VERSION_3_0) {
-		begin_bloom();
+		draw_with_bloom(draw_scene);
+	} else {
 		draw_scene();
-		end_bloom();
-	}
-
-	draw_scene();
-
-	if (GLEW_VERSION_3_0) {
-		draw_bloom();
 	}
 
 	glMatrixMode(GL_PROJECTION);
@@ -516,24 +489,16 @@ void draw_menu()
 	glMatrixMode(GL_MODELVIEW);
 	glLoadIdentity();
 
-	{
-		GLState state;
-		state.enable(GL_TEXTURE_2D);
-		state.enable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
-		Color color(1, 1, 1);
-		if (uniform() < 0.05)
-			color.r = 0;
-		glColor(color);
-		vec2 pos(screen->w/2 - 256, 50);
-		if (uniform() < 0.02)
-			pos.x += 10;
-		glBindTexture(GL_TEXTURE_2D, logo);
-		draw_quad(pos, vec2(512, 256));
-	}
+	Color color(1, 1, 1);
+	if (uniform() < 0.05)
+		color.r = 0;
+	vec2 pos(screen->w/2 - 256, 50);
+	if (uniform() < 0.02)
+		pos.x += 10;
+	sprite_batch.draw(get_sprite("logo.png"), pos, vec2(512, 256), color);
 
 	if (show_credits) {
+		sprite_batch.flush();
 		glColor(white);
 		vera.draw_text(vec2(screen->w/2 - 300, screen->h/2 - 50),
 			"SEKO\nfor Assembly 2012\n\n"
@@ -544,15 +509,11 @@ void draw_menu()
 		return;
 	}
 	if (show_help) {
-		GLState state;
-		state.enable(GL_TEXTURE_2D);
-		state.enable(GL_BLEND);
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-
+		sprite_batch.draw(get_sprite("help.png"),
+				  vec2(screen->w/2 - 256, screen->h/2),
+				  vec2(512, 256), white);
+		sprite_batch.flush();
 		glColor(white);
-		vec2 pos(screen->w/2 - 256, screen->h/2);
-		glBindTexture(GL_TEXTURE_2D, help);
-		draw_quad(pos, vec2(512, 256));
 		vera.draw_text(vec2(screen->w/2 - 300, screen->h/2 + 256),
 			"Move the dancer with mouse (or a finger) and follow the moves\n"
 			"on the right hand side of the screen. You will get bonuses\n"
@@ -564,21 +525,12 @@ void draw_menu()
 
 	Color inactive(0.7, 0.7, 0.7);
 
-	GLState state;
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	state.enable(GL_TEXTURE_2D);
-	state.enable(GL_BLEND);
-
 	for (int i = 0; i < MAX_MENU; ++i) {
-		if (sel == i) {
-			glColor(white);
-		} else {
-			glColor(inactive);
-		}
 		vec2 pos(screen->w - 256 - 50, screen->h/2 + i * 64);
-		glBindTexture(GL_TEXTURE_2D, menu_pics[i]);
-		draw_quad(pos, vec2(256, 64));
+		sprite_batch.draw(get_sprite(menu_picnames[i]), pos,
+				  vec2(256, 64), sel == i ? white : inactive);
 	}
+	sprite_batch.flush();
 }
 
 }
@@ -586,22 +538,37 @@ void draw_menu()
 void play()
 {
 	score = 0;
-	secret = rand() & 0xffffff;
+	secret = random_u64() & 0xffffff;
 	level = levels;
+	prefetch_level(level);
 	intermission_menu();
 	while (level->name != NULL) {
 		if (!game())
 			break;
 		level++;
+		if (level->name != NULL) {
+			prefetch_level(level);
+		}
 		intermission_menu();
 	}
+	/* whatever was prepared for a level is not played now */
+	cancel_music();
 	play_music("menu.ogg");
 	highscores_menu();
 }
 
+void preload_menu()
+{
+	start_load(new SkeletonJob(&dancer, "human.obj", vec3(0, 7, 0)));
+	load_sprites_async();
+	prepare_music("menu.ogg");
+}
+
 void menu()
 {
 	bool quit = false;
+	bool first_frame = true;
+	finish_all_loads();
 	if (dancer.joints.empty()) {
 		load_skeleton(&dancer, "human.obj", vec3(0, 7, 0));
 	}
@@ -672,6 +639,11 @@ void menu()
 		draw_menu();
 
 		SDL_GL_SwapBuffers();
+		if (first_frame) {
+			startup_trace("first frame");
+			first_frame = false;
+		}
+		finish_loads();
 		SDL_Delay(5);
 		check_gl_errors();
 	}
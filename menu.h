@@ -1 +1,3 @@
+/* Starts loading what the first frame needs, no GL yet */
+void preload_menu();
 void menu();
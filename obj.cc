@@ -0,0 +1,461 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Wavefront OBJ and MTL loading
+ */
+#include "gl.h"
+#include "mapfile.h"
+#include "archive.h"
+#include "cpu.h"
+#include "loader.h"
+#include <SDL.h>
+#include <stdexcept>
+#include <string.h>
+
+namespace {
+
+/* Smaller pieces are not worth a thread */
+const size_t MIN_CHUNK_SIZE = 64 * 1024;
+const int MAX_CHUNKS = 16;
+
+/* Faces after an usemtl, or from the start of a chunk if material is empty */
+struct FaceRun {
+	std::string material;
+	std::vector<Face> faces;
+};
+
+struct Chunk {
+	const char *begin, *end;
+	double scale;
+	vec3 origo;
+	std::vector<vec3> vertices, normals;
+	std::vector<std::string> mtllibs;
+	std::list<FaceRun> runs;
+	std::string error;
+};
+
+bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+const char *skip_space(const char *p, const char *end)
+{
+	while (p < end && is_space(*p))
+		p++;
+	return p;
+}
+
+/* Next word on the line, empty at the end */
+std::pair<const char *, const char *> next_token(const char **pos,
+						 const char *end)
+{
+	const char *p = skip_space(*pos, end);
+	const char *start = p;
+	while (p < end && !is_space(*p))
+		p++;
+	*pos = p;
+	return std::make_pair(start, p);
+}
+
+bool token_is(const std::pair<const char *, const char *> &token,
+	      const char *word)
+{
+	size_t len = strlen(word);
+	return size_t(token.second - token.first) == len &&
+	       memcmp(token.first, word, len) == 0;
+}
+
+double power10(int exp)
+{
+	static const double table[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+		1e21, 1e22,
+	};
+	if (exp >= 0 && exp < int(ARRAY_SIZE(table)))
+		return table[exp];
+	return pow(10.0, exp);
+}
+
+/*
+ * Decimal with an optional exponent. Not locale dependent, and exact for
+ * the short numbers exporters write.
+ */
+bool parse_double(const char **pos, const char *end, double *out)
+{
+	const char *p = skip_space(*pos, end);
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	uint64_t mantissa = 0;
+	int exp = 0;
+	int digits = 0;
+	for (; p < end && is_digit(*p); ++p, ++digits) {
+		if (mantissa < 100000000000000000ULL) {
+			mantissa = mantissa * 10 + (*p - '0');
+		} else {
+			exp++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && is_digit(*p); ++p, ++digits) {
+			if (mantissa < 100000000000000000ULL) {
+				mantissa = mantissa * 10 + (*p - '0');
+				exp--;
+			}
+		}
+	}
+	if (digits == 0)
+		return false;
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool exp_negative = false;
+		if (p < end && (*p == '-' || *p == '+')) {
+			exp_negative = *p == '-';
+			p++;
+		}
+		int e = 0;
+		for (; p < end && is_digit(*p); ++p) {
+			e = std::min(e * 10 + (*p - '0'), 1000);
+		}
+		exp += exp_negative ? -e : e;
+	}
+	double v = mantissa;
+	if (exp < 0) {
+		v /= power10(-exp);
+	} else {
+		v *= power10(exp);
+	}
+	*out = negative ? -v : v;
+	*pos = p;
+	return true;
+}
+
+bool parse_vec3(const char **pos, const char *end, vec3 *v)
+{
+	return parse_double(pos, end, &v->x) && parse_double(pos, end, &v->y) &&
+	       parse_double(pos, end, &v->z);
+}
+
+/* OBJ indices start from one */
+bool parse_index(const char **pos, const char *end, size_t *out)
+{
+	const char *p = *pos;
+	size_t v = 0;
+	for (; p < end && is_digit(*p); ++p) {
+		v = v * 10 + (*p - '0');
+	}
+	if (p == *pos || v == 0)
+		return false;
+	*out = v - 1;
+	*pos = p;
+	return true;
+}
+
+/* v, v/vt, v//vn or v/vt/vn; texture coordinates are not used */
+bool parse_corner(const char **pos, const char *end, Face *f, int i)
+{
+	*pos = skip_space(*pos, end);
+	if (!parse_index(pos, end, &f->vert[i]))
+		return false;
+	f->norm[i] = 0;
+	const char *p = *pos;
+	if (p < end && *p == '/') {
+		p++;
+		size_t texcoord;
+		parse_index(&p, end, &texcoord);
+		if (p < end && *p == '/') {
+			p++;
+			if (!parse_index(&p, end, &f->norm[i]))
+				return false;
+		}
+	}
+	*pos = p;
+	return true;
+}
+
+void parse_chunk(Chunk *chunk)
+{
+	chunk->runs.push_back(FaceRun());
+	FaceRun *run = &chunk->runs.back();
+
+	const char *p = chunk->begin;
+	while (p < chunk->end) {
+		const char *eol = (const char *) memchr(p, '\n', chunk->end - p);
+		if (eol == NULL)
+			eol = chunk->end;
+
+		std::pair<const char *, const char *> token =
+			next_token(&p, eol);
+		if (token_is(token, "v")) {
+			vec3 v;
+			if (!parse_vec3(&p, eol, &v)) {
+				throw std::runtime_error("Corrupted mesh file");
+			}
+			chunk->vertices.push_back(v * chunk->scale +
+						  chunk->origo);
+		} else if (token_is(token, "vn")) {
+			vec3 v;
+			if (!parse_vec3(&p, eol, &v)) {
+				throw std::runtime_error("Corrupted mesh file");
+			}
+			chunk->normals.push_back(v);
+		} else if (token_is(token, "f")) {
+			Face f;
+			int i = 0;
+			while (i < 3 && parse_corner(&p, eol, &f, i))
+				i++;
+			/* only triangles, like the exporter writes them */
+			if (i == 3) {
+				run->faces.push_back(f);
+			}
+		} else if (token_is(token, "usemtl")) {
+			token = next_token(&p, eol);
+			chunk->runs.push_back(FaceRun());
+			run = &chunk->runs.back();
+			run->material.assign(token.first, token.second);
+		} else if (token_is(token, "mtllib")) {
+			token = next_token(&p, eol);
+			chunk->mtllibs.push_back(std::string(token.first,
+							     token.second));
+		}
+		p = eol + 1;
+	}
+}
+
+int parse_thread(void *arg)
+{
+	Chunk *chunk = (Chunk *) arg;
+	try {
+		parse_chunk(chunk);
+	} catch (const std::exception &e) {
+		chunk->error = e.what();
+	}
+	return 0;
+}
+
+void load_materials(group_map_t &groups, const char *fname)
+{
+	MappedFile file(fname);
+	const char *p = file.data();
+	const char *end = p + file.size();
+	Group *group = NULL;
+	while (p < end) {
+		const char *eol = (const char *) memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+
+		std::pair<const char *, const char *> token =
+			next_token(&p, eol);
+		if (token_is(token, "newmtl")) {
+			token = next_token(&p, eol);
+			std::pair<group_map_t::iterator, bool> res =
+				groups.insert(std::make_pair(
+					std::string(token.first, token.second),
+					Group()));
+			group = &res.first->second;
+		} else if (token_is(token, "Kd")) {
+			vec3 kd;
+			if (group == NULL || !parse_vec3(&p, eol, &kd)) {
+				throw std::runtime_error("Corrupted material file");
+			}
+			group->diffuse = Color(kd.x, kd.y, kd.z);
+		}
+		p = eol + 1;
+	}
+}
+
+void read_vec3(AssetReader *reader, vec3 *v)
+{
+	v->x = reader->get<double>();
+	v->y = reader->get<double>();
+	v->z = reader->get<double>();
+}
+
+void read_mesh(Mesh *mesh, const Asset *asset, double scale,
+	       const vec3 &origo)
+{
+	AssetReader reader(asset);
+	mesh->vertices.resize(reader.get<uint32_t>());
+	FOR_EACH(std::vector<vec3>, v, mesh->vertices) {
+		read_vec3(&reader, &*v);
+		*v = *v * scale + origo;
+	}
+	mesh->normals.resize(reader.get<uint32_t>());
+	FOR_EACH(std::vector<vec3>, v, mesh->normals) {
+		read_vec3(&reader, &*v);
+	}
+	uint32_t num_groups = reader.get<uint32_t>();
+	for (uint32_t i = 0; i < num_groups; ++i) {
+		std::string name = reader.get_string();
+		Group *group = &mesh->groups[name];
+		group->diffuse = reader.get<Color>();
+		group->faces.resize(reader.get<uint32_t>());
+		FOR_EACH(std::vector<Face>, face, group->faces) {
+			for (int j = 0; j < 3; ++j) {
+				face->vert[j] = reader.get<uint32_t>();
+				face->norm[j] = reader.get<uint32_t>();
+				if (face->vert[j] >= mesh->vertices.size() ||
+				    face->norm[j] >= mesh->normals.size()) {
+					throw std::runtime_error("Corrupted archive");
+				}
+			}
+		}
+	}
+}
+
+}
+
+/*
+ * The file is cut into chunks at line ends and parsed in parallel. Indices
+ * in OBJ are global, so the chunks only need to be joined in order.
+ */
+void load_mesh(Mesh *mesh, const char *fname, double scale, const vec3 &origo)
+{
+	const Asset *asset = find_asset(fname, ASSET_MESH);
+	if (asset != NULL) {
+		debug("loading %s\n", fname);
+		read_mesh(mesh, asset, scale, origo);
+		return;
+	}
+
+	Uint32 start = SDL_GetTicks();
+	MappedFile file(fname);
+	const char *data = file.data();
+	const char *end = data + file.size();
+
+	int num_chunks = std::min(std::min(num_cpus(), MAX_CHUNKS),
+				  int(file.size() / MIN_CHUNK_SIZE) + 1);
+	if (on_loader_thread()) {
+		num_chunks = 1;
+	}
+	std::vector<Chunk> chunks(num_chunks);
+	const char *p = data;
+	for (int i = 0; i < num_chunks; ++i) {
+		Chunk *chunk = &chunks[i];
+		chunk->begin = p;
+		if (i == num_chunks - 1) {
+			p = end;
+		} else {
+			p = std::max(p, data + file.size() * (i + 1) / num_chunks);
+			const char *eol = (const char *) memchr(p, '\n', end - p);
+			p = eol ? eol + 1 : end;
+		}
+		chunk->end = p;
+		chunk->scale = scale;
+		chunk->origo = origo;
+	}
+
+	/* the calling thread takes the first chunk */
+	std::vector<SDL_Thread *> threads;
+	for (int i = 1; i < num_chunks; ++i) {
+		SDL_Thread *thread = SDL_CreateThread(parse_thread, &chunks[i]);
+		if (thread == NULL) {
+			parse_thread(&chunks[i]);
+		}
+		threads.push_back(thread);
+	}
+	parse_thread(&chunks[0]);
+	FOR_EACH(std::vector<SDL_Thread *>, thread, threads) {
+		if (*thread != NULL) {
+			SDL_WaitThread(*thread, NULL);
+		}
+	}
+
+	Group *group = NULL;
+	FOR_EACH(std::vector<Chunk>, chunk, chunks) {
+		if (!chunk->error.empty()) {
+			throw std::runtime_error(strf("%s: %s", fname,
+						      chunk->error.c_str()));
+		}
+		FOR_EACH_CONST(std::vector<std::string>, name, chunk->mtllibs) {
+			load_materials(mesh->groups, name->c_str());
+		}
+		mesh->vertices.insert(mesh->vertices.end(),
+				      chunk->vertices.begin(),
+				      chunk->vertices.end());
+		mesh->normals.insert(mesh->normals.end(),
+				     chunk->normals.begin(),
+				     chunk->normals.end());
+		FOR_EACH(std::list<FaceRun>, run, chunk->runs) {
+			if (!run->material.empty()) {
+				std::pair<group_map_t::iterator, bool> res =
+					mesh->groups.insert(std::make_pair(
+						run->material, Group()));
+				group = &res.first->second;
+			}
+			if (run->faces.empty())
+				continue;
+			if (group == NULL) {
+				throw std::runtime_error(strf(
+					"%s: Faces without a material", fname));
+			}
+			group->faces.insert(group->faces.end(),
+					    run->faces.begin(),
+					    run->faces.end());
+		}
+	}
+
+	FOR_EACH_CONST(group_map_t, iter, mesh->groups) {
+		FOR_EACH_CONST(std::vector<Face>, face, iter->second.faces) {
+			for (int i = 0; i < 3; ++i) {
+				if (face->vert[i] >= mesh->vertices.size() ||
+				    face->norm[i] >= mesh->normals.size()) {
+					throw std::runtime_error(strf(
+						"%s: Corrupted mesh file", fname));
+				}
+			}
+		}
+	}
+
+	Uint32 ms = std::max(SDL_GetTicks() - start, Uint32(1));
+	debug("%s: %zd KB in %d ms with %d threads, %.1f MB/s\n", fname,
+	      file.size() / 1024, ms, num_chunks,
+	      file.size() / (ms * 1e-3) / (1024 * 1024));
+}
+
+/* Materials are folded in, so the MTL files are not needed */
+void pack_mesh(const char *fname, std::string *out)
+{
+	Mesh mesh;
+	load_mesh(&mesh, fname);
+	put(out, uint32_t(mesh.vertices.size()));
+	FOR_EACH_CONST(std::vector<vec3>, v, mesh.vertices) {
+		put(out, v->x);
+		put(out, v->y);
+		put(out, v->z);
+	}
+	put(out, uint32_t(mesh.normals.size()));
+	FOR_EACH_CONST(std::vector<vec3>, v, mesh.normals) {
+		put(out, v->x);
+		put(out, v->y);
+		put(out, v->z);
+	}
+	put(out, uint32_t(mesh.groups.size()));
+	FOR_EACH_CONST(group_map_t, iter, mesh.groups) {
+		const Group *group = &iter->second;
+		put_string(out, iter->first);
+		put(out, group->diffuse);
+		put(out, uint32_t(group->faces.size()));
+		FOR_EACH_CONST(std::vector<Face>, face, group->faces) {
+			for (int j = 0; j < 3; ++j) {
+				put(out, uint32_t(face->vert[j]));
+				put(out, uint32_t(face->norm[j]));
+			}
+		}
+	}
+}
@@ -0,0 +1,88 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Particle pool
+ */
+#include "particles.h"
+#include "utils.h"
+#include "cpu.h"
+
+namespace {
+
+void copy(ParticlePool *pool, size_t to, size_t from)
+{
+	pool->x[to] = pool->x[from];
+	pool->y[to] = pool->y[from];
+	pool->z[to] = pool->z[from];
+	pool->vx[to] = pool->vx[from];
+	pool->vy[to] = pool->vy[from];
+	pool->vz[to] = pool->vz[from];
+	pool->time[to] = pool->time[from];
+	pool->duration[to] = pool->duration[from];
+	pool->size[to] = pool->size[from];
+	pool->r[to] = pool->r[from];
+	pool->g[to] = pool->g[from];
+	pool->b[to] = pool->b[from];
+	pool->a[to] = pool->a[from];
+}
+
+}
+
+bool add_particle(ParticlePool *pool, const vec3 &pos, const vec3 &vel,
+		  const Color &color, double time, double duration,
+		  double size)
+{
+	if (pool->count >= MAX_PARTICLES) {
+		return false;
+	}
+	size_t i = pool->count++;
+	pool->x[i] = pos.x;
+	pool->y[i] = pos.y;
+	pool->z[i] = pos.z;
+	pool->vx[i] = vel.x;
+	pool->vy[i] = vel.y;
+	pool->vz[i] = vel.z;
+	pool->time[i] = time;
+	pool->duration[i] = duration;
+	pool->size[i] = size;
+	pool->r[i] = color.r;
+	pool->g[i] = color.g;
+	pool->b[i] = color.b;
+	pool->a[i] = color.a;
+	return true;
+}
+
+void update_particles(ParticlePool *pool, double dt)
+{
+	kernels.integrate(pool->count, dt, pool->x, pool->y, pool->z,
+			  pool->vx, pool->vy, pool->vz, pool->time);
+
+	/*
+	 * Each particle gets a random kick with probability dt. Rather than
+	 * rolling for every particle, jump straight to the next one hit.
+	 */
+	if (dt > 0) {
+		double log_miss = log(1 - std::min(dt, 0.999));
+		double next = log(1 - uniform()) / log_miss;
+		while (next < pool->count) {
+			size_t i = size_t(next);
+			pool->vx[i] += (uniform() - 0.5) * dt;
+			pool->vy[i] += (uniform() - 0.5) * dt;
+			pool->vz[i] += (uniform() - 0.5) * dt;
+			next = i + 1 + log(1 - uniform()) / log_miss;
+		}
+	}
+
+	/* swap the last live particle into each dead slot */
+	for (size_t i = pool->count; i-- > 0;) {
+		if (pool->time[i] > pool->duration[i]) {
+			copy(pool, i, --pool->count);
+		}
+	}
+}
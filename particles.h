@@ -0,0 +1,37 @@
+#ifndef __particles_h
+#define __particles_h
+
+#include "gl.h"
+
+/* Hard budget, particles beyond this are dropped */
+const size_t MAX_PARTICLES = 16384;
+
+#define PARTICLE_ARRAY(name) \
+	float name[MAX_PARTICLES] __attribute__((aligned(16)))
+
+/* Structure of arrays, the first count entries are alive */
+struct ParticlePool {
+	size_t count;
+	PARTICLE_ARRAY(x);
+	PARTICLE_ARRAY(y);
+	PARTICLE_ARRAY(z);
+	PARTICLE_ARRAY(vx);
+	PARTICLE_ARRAY(vy);
+	PARTICLE_ARRAY(vz);
+	PARTICLE_ARRAY(time);
+	PARTICLE_ARRAY(duration);
+	PARTICLE_ARRAY(size);
+	PARTICLE_ARRAY(r);
+	PARTICLE_ARRAY(g);
+	PARTICLE_ARRAY(b);
+	PARTICLE_ARRAY(a);
+};
+
+#undef PARTICLE_ARRAY
+
+bool add_particle(ParticlePool *pool, const vec3 &pos, const vec3 &vel,
+		  const Color &color, double time, double duration,
+		  double size);
+void update_particles(ParticlePool *pool, double dt);
+
+#endif
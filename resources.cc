@@ -0,0 +1,311 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Shared, reference counted assets
+ */
+#include "resources.h"
+#include "loader.h"
+#include <map>
+
+size_t gpu_budget = 128 << 20;
+size_t cpu_budget = 64 << 20;
+
+struct Resource {
+	ResourceType type;
+	std::string name;
+	int refs;
+	uint64_t last_used;
+
+	Resource(ResourceType i_type, const std::string &i_name) :
+		type(i_type), name(i_name), refs(0), last_used(0)
+	{}
+	virtual ~Resource() {}
+
+	DISABLE_COPY_AND_ASSIGN(Resource);
+};
+
+namespace {
+
+struct TextureResource : public Resource {
+	GLuint texture;
+	/* set by the texture job */
+	size_t bytes;
+
+	TextureResource(const std::string &name) :
+		Resource(RESOURCE_TEXTURE, name), texture(INVALID_TEXTURE),
+		bytes(0)
+	{}
+	~TextureResource() { glDeleteTextures(1, &texture); }
+};
+
+struct ModelResource : public Resource {
+	Model model;
+
+	ModelResource(const std::string &name) :
+		Resource(RESOURCE_MODEL, name)
+	{}
+};
+
+struct SoundResource : public Resource {
+	Sound sound;
+
+	SoundResource(const std::string &name) :
+		Resource(RESOURCE_SOUND, name)
+	{}
+	/* the mixer may still be reading it */
+	~SoundResource() { stop_sound(&sound); }
+};
+
+const TextureResource *as_texture(const Resource *res)
+{
+	return static_cast<const TextureResource *>(res);
+}
+
+const ModelResource *as_model(const Resource *res)
+{
+	return static_cast<const ModelResource *>(res);
+}
+
+const SoundResource *as_sound(const Resource *res)
+{
+	return static_cast<const SoundResource *>(res);
+}
+
+typedef std::map<std::string, Resource *> resource_map_t;
+
+const char *type_names[NUM_RESOURCE_TYPES] = {
+	"texture", "model", "sound",
+};
+
+uint64_t use_clock = 0;
+
+/* Never destroyed, handles in other globals may outlive it */
+resource_map_t &resources()
+{
+	static resource_map_t *map = new resource_map_t;
+	return *map;
+}
+
+/* Until then, a pending job may write to it */
+bool loaded(const Resource *res)
+{
+	switch (res->type) {
+	case RESOURCE_TEXTURE:
+		return as_texture(res)->bytes > 0;
+	case RESOURCE_MODEL:
+		return !as_model(res)->model.loading();
+	case RESOURCE_SOUND:
+		return !as_sound(res)->sound.empty();
+	default:
+		break;
+	}
+	assert(0);
+	return false;
+}
+
+size_t resource_bytes(const Resource *res)
+{
+	switch (res->type) {
+	case RESOURCE_TEXTURE:
+		return as_texture(res)->bytes;
+	case RESOURCE_MODEL:
+		return as_model(res)->model.gpu_bytes();
+	case RESOURCE_SOUND:
+		/* the ones in the archive are only mapped */
+		return as_sound(res)->sound.data.size() * sizeof(int16_t);
+	default:
+		break;
+	}
+	assert(0);
+	return 0;
+}
+
+bool on_gpu(ResourceType type)
+{
+	return type != RESOURCE_SOUND;
+}
+
+void free_resource(Resource *res)
+{
+	debug("evicting %s %s, %zd bytes\n", type_names[res->type],
+	      res->name.c_str(), resource_bytes(res));
+	resources().erase(res->name);
+	delete res;
+}
+
+/* The least recently used one that can be freed, or NULL */
+Resource *eviction_candidate(bool gpu)
+{
+	Resource *oldest = NULL;
+	FOR_EACH_CONST(resource_map_t, i, resources()) {
+		Resource *res = i->second;
+		if (res->refs > 0 || on_gpu(res->type) != gpu || !loaded(res))
+			continue;
+		/* nothing to gain from the ones in the archive */
+		if (resource_bytes(res) == 0)
+			continue;
+		if (oldest == NULL || res->last_used < oldest->last_used)
+			oldest = res;
+	}
+	return oldest;
+}
+
+void trim(bool gpu, size_t budget)
+{
+	size_t total = 0;
+	FOR_EACH_CONST(resource_map_t, i, resources()) {
+		if (on_gpu(i->second->type) == gpu)
+			total += resource_bytes(i->second);
+	}
+	while (total > budget) {
+		Resource *res = eviction_candidate(gpu);
+		if (res == NULL)
+			break;
+		total -= resource_bytes(res);
+		free_resource(res);
+	}
+}
+
+/* NULL if it has to be loaded first */
+Resource *find_resource(ResourceType type, const std::string &name)
+{
+	resource_map_t::const_iterator i = resources().find(name);
+	if (i == resources().end())
+		return NULL;
+	if (i->second->type != type) {
+		throw std::runtime_error(strf("Not a %s: %s", type_names[type],
+					      name.c_str()));
+	}
+	return i->second;
+}
+
+/* Takes the ownership */
+void add_resource(Resource *res)
+{
+	/* make room for it, if the ones loaded so far need it */
+	trim_resources();
+	ins(resources(), res->name, res);
+}
+
+}
+
+ResourceHandle::ResourceHandle(Resource *res) :
+	m_res(res)
+{
+	m_res->refs++;
+	use();
+}
+
+ResourceHandle::ResourceHandle(const ResourceHandle &from) :
+	m_res(from.m_res)
+{
+	if (m_res != NULL) {
+		m_res->refs++;
+	}
+}
+
+ResourceHandle::~ResourceHandle()
+{
+	if (m_res != NULL) {
+		m_res->refs--;
+	}
+}
+
+ResourceHandle &ResourceHandle::operator=(const ResourceHandle &from)
+{
+	if (from.m_res != NULL) {
+		from.m_res->refs++;
+	}
+	if (m_res != NULL) {
+		m_res->refs--;
+	}
+	m_res = from.m_res;
+	return *this;
+}
+
+void ResourceHandle::wait() const
+{
+	while (m_res != NULL && !loaded(m_res) && finish_load()) {
+	}
+}
+
+Resource *ResourceHandle::use() const
+{
+	m_res->last_used = ++use_clock;
+	return m_res;
+}
+
+GLuint TextureHandle::get() const
+{
+	return static_cast<TextureResource *>(use())->texture;
+}
+
+Model *ModelHandle::get() const
+{
+	return &static_cast<ModelResource *>(use())->model;
+}
+
+const Sound *SoundHandle::get() const
+{
+	return &static_cast<SoundResource *>(use())->sound;
+}
+
+TextureHandle get_texture(const char *fname)
+{
+	Resource *res = find_resource(RESOURCE_TEXTURE, fname);
+	if (res == NULL) {
+		TextureResource *tex = new TextureResource(fname);
+		add_resource(tex);
+		load_png_async(&tex->texture, fname, &tex->bytes);
+		res = tex;
+	}
+	return TextureHandle(res);
+}
+
+ModelHandle get_model(const char *fname, double scale)
+{
+	/* a different scale is a different model */
+	std::string name = strf("%s@%g", fname, scale);
+	Resource *res = find_resource(RESOURCE_MODEL, name);
+	if (res == NULL) {
+		ModelResource *model = new ModelResource(name);
+		add_resource(model);
+		model->model.load_async(fname, scale);
+		res = model;
+	}
+	return ModelHandle(res);
+}
+
+SoundHandle get_sound(const char *fname)
+{
+	Resource *res = find_resource(RESOURCE_SOUND, fname);
+	if (res == NULL) {
+		SoundResource *sound = new SoundResource(fname);
+		add_resource(sound);
+		load_sound_async(&sound->sound, fname);
+		res = sound;
+	}
+	return SoundHandle(res);
+}
+
+void trim_resources()
+{
+	trim(true, gpu_budget);
+	trim(false, cpu_budget);
+}
+
+size_t resident_bytes(ResourceType type)
+{
+	size_t total = 0;
+	FOR_EACH_CONST(resource_map_t, i, resources()) {
+		if (i->second->type == type)
+			total += resource_bytes(i->second);
+	}
+	return total;
+}
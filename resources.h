@@ -0,0 +1,79 @@
+#ifndef __resources_h
+#define __resources_h
+
+#include "gl.h"
+#include "sound.h"
+
+enum ResourceType {
+	RESOURCE_TEXTURE,
+	RESOURCE_MODEL,
+	RESOURCE_SOUND,
+	NUM_RESOURCE_TYPES
+};
+
+/* Textures and models count against the GPU budget, sounds the CPU one */
+extern size_t gpu_budget;
+extern size_t cpu_budget;
+
+struct Resource;
+
+/*
+ * A reference to a loaded asset. Assets nothing refers to stay cached
+ * until the budget runs out, the least recently used goes first.
+ */
+class ResourceHandle {
+public:
+	ResourceHandle() : m_res(NULL) {}
+	explicit ResourceHandle(Resource *res);
+	ResourceHandle(const ResourceHandle &from);
+	~ResourceHandle();
+
+	ResourceHandle &operator=(const ResourceHandle &from);
+	bool empty() const { return m_res == NULL; }
+	/* Finishes loader jobs until this one is loaded */
+	void wait() const;
+
+protected:
+	/* marks it used */
+	Resource *use() const;
+
+private:
+	Resource *m_res;
+};
+
+class TextureHandle : public ResourceHandle {
+public:
+	TextureHandle() {}
+	explicit TextureHandle(Resource *res) : ResourceHandle(res) {}
+
+	/* A placeholder while loading */
+	GLuint get() const;
+};
+
+class ModelHandle : public ResourceHandle {
+public:
+	ModelHandle() {}
+	explicit ModelHandle(Resource *res) : ResourceHandle(res) {}
+
+	Model *get() const;
+	Model *operator->() const { return get(); }
+};
+
+class SoundHandle : public ResourceHandle {
+public:
+	SoundHandle() {}
+	explicit SoundHandle(Resource *res) : ResourceHandle(res) {}
+
+	const Sound *get() const;
+};
+
+/* Loaded on the loader threads if not cached */
+TextureHandle get_texture(const char *fname);
+ModelHandle get_model(const char *fname, double scale=1);
+SoundHandle get_sound(const char *fname);
+
+/* Evicts unused assets until the budgets hold */
+void trim_resources();
+size_t resident_bytes(ResourceType type);
+
+#endif
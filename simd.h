@@ -0,0 +1,232 @@
+#ifndef __simd_h
+#define __simd_h
+
+/*
+ * Float vectors for the structure-of-arrays loops in kernels.inc, and only
+ * for those: vec2 and vec3 stay scalar doubles. vec4f is an SSE register
+ * (or four plain floats without SSE2), vec8f an AVX register when built
+ * with -mavx2 and vec16f an AVX-512 register with -mavx512f. vecf is the
+ * widest one available, use it with VECF_WIDTH.
+ * Loads and stores do not need aligned pointers.
+ */
+
+#include <stddef.h>
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+class vec4f {
+public:
+#ifdef __SSE2__
+	__m128 v;
+
+	vec4f() {}
+	vec4f(__m128 i_v) : v(i_v) {}
+	explicit vec4f(float s) : v(_mm_set1_ps(s)) {}
+
+	static vec4f load(const float *p) { return vec4f(_mm_loadu_ps(p)); }
+	static vec4f gather(const float *base, const int *index)
+	{
+		return _mm_setr_ps(base[index[0]], base[index[1]],
+				   base[index[2]], base[index[3]]);
+	}
+	void store(float *p) const { _mm_storeu_ps(p, v); }
+#else
+	float v[4];
+
+	vec4f() {}
+	explicit vec4f(float s)
+	{
+		for (int i = 0; i < 4; ++i)
+			v[i] = s;
+	}
+
+	static vec4f load(const float *p)
+	{
+		vec4f r;
+		for (int i = 0; i < 4; ++i)
+			r.v[i] = p[i];
+		return r;
+	}
+	static vec4f gather(const float *base, const int *index)
+	{
+		vec4f r;
+		for (int i = 0; i < 4; ++i)
+			r.v[i] = base[index[i]];
+		return r;
+	}
+	void store(float *p) const
+	{
+		for (int i = 0; i < 4; ++i)
+			p[i] = v[i];
+	}
+#endif
+};
+
+#ifdef __SSE2__
+
+extern inline vec4f operator + (const vec4f &a, const vec4f &b)
+{
+	return _mm_add_ps(a.v, b.v);
+}
+
+extern inline vec4f operator - (const vec4f &a, const vec4f &b)
+{
+	return _mm_sub_ps(a.v, b.v);
+}
+
+extern inline vec4f operator * (const vec4f &a, const vec4f &b)
+{
+	return _mm_mul_ps(a.v, b.v);
+}
+
+extern inline vec4f operator / (const vec4f &a, const vec4f &b)
+{
+	return _mm_div_ps(a.v, b.v);
+}
+
+extern inline vec4f sqrt(const vec4f &a)
+{
+	return _mm_sqrt_ps(a.v);
+}
+
+#else
+
+#define VEC4F_OP(op) \
+	extern inline vec4f operator op (const vec4f &a, const vec4f &b) \
+	{ \
+		vec4f r; \
+		for (int i = 0; i < 4; ++i) \
+			r.v[i] = a.v[i] op b.v[i]; \
+		return r; \
+	}
+
+VEC4F_OP(+)
+VEC4F_OP(-)
+VEC4F_OP(*)
+VEC4F_OP(/)
+
+#undef VEC4F_OP
+
+extern inline vec4f sqrt(const vec4f &a)
+{
+	vec4f r;
+	for (int i = 0; i < 4; ++i)
+		r.v[i] = sqrtf(a.v[i]);
+	return r;
+}
+
+#endif
+
+#ifdef __AVX2__
+
+class vec8f {
+public:
+	__m256 v;
+
+	vec8f() {}
+	vec8f(__m256 i_v) : v(i_v) {}
+	explicit vec8f(float s) : v(_mm256_set1_ps(s)) {}
+
+	static vec8f load(const float *p) { return vec8f(_mm256_loadu_ps(p)); }
+	static vec8f gather(const float *base, const int *index)
+	{
+		return _mm256_i32gather_ps(base,
+			_mm256_loadu_si256((const __m256i *) index), 4);
+	}
+	void store(float *p) const { _mm256_storeu_ps(p, v); }
+};
+
+extern inline vec8f operator + (const vec8f &a, const vec8f &b)
+{
+	return _mm256_add_ps(a.v, b.v);
+}
+
+extern inline vec8f operator - (const vec8f &a, const vec8f &b)
+{
+	return _mm256_sub_ps(a.v, b.v);
+}
+
+extern inline vec8f operator * (const vec8f &a, const vec8f &b)
+{
+	return _mm256_mul_ps(a.v, b.v);
+}
+
+extern inline vec8f operator / (const vec8f &a, const vec8f &b)
+{
+	return _mm256_div_ps(a.v, b.v);
+}
+
+extern inline vec8f sqrt(const vec8f &a)
+{
+	return _mm256_sqrt_ps(a.v);
+}
+
+#endif
+
+#ifdef __AVX512F__
+
+class vec16f {
+public:
+	__m512 v;
+
+	vec16f() {}
+	vec16f(__m512 i_v) : v(i_v) {}
+	explicit vec16f(float s) : v(_mm512_set1_ps(s)) {}
+
+	static vec16f load(const float *p) { return vec16f(_mm512_loadu_ps(p)); }
+	static vec16f gather(const float *base, const int *index)
+	{
+		/* the unmasked gather warns in GCC's own header */
+		return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff,
+						_mm512_loadu_si512(index),
+						base, 4);
+	}
+	void store(float *p) const { _mm512_storeu_ps(p, v); }
+};
+
+extern inline vec16f operator + (const vec16f &a, const vec16f &b)
+{
+	return _mm512_add_ps(a.v, b.v);
+}
+
+extern inline vec16f operator - (const vec16f &a, const vec16f &b)
+{
+	return _mm512_sub_ps(a.v, b.v);
+}
+
+extern inline vec16f operator * (const vec16f &a, const vec16f &b)
+{
+	return _mm512_mul_ps(a.v, b.v);
+}
+
+extern inline vec16f operator / (const vec16f &a, const vec16f &b)
+{
+	return _mm512_div_ps(a.v, b.v);
+}
+
+extern inline vec16f sqrt(const vec16f &a)
+{
+	return _mm512_sqrt_ps(a.v);
+}
+
+typedef vec16f vecf;
+const size_t VECF_WIDTH = 16;
+
+#elif defined(__AVX2__)
+
+typedef vec8f vecf;
+const size_t VECF_WIDTH = 8;
+
+#else
+
+typedef vec4f vecf;
+const size_t VECF_WIDTH = 4;
+
+#endif
+
+#endif
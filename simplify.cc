@@ -0,0 +1,269 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Mesh simplification with quadric error metrics
+ */
+#include "simplify.h"
+#include "utils.h"
+#include <queue>
+
+namespace {
+
+/* Penalty for moving open edges, keeps the silhouette and seams intact */
+const double BOUNDARY_WEIGHT = 100;
+
+/* Collapses that turn a face more than this are rejected */
+const double MIN_FLIP_DOT = 0.2;
+
+/* Symmetric 4x4 matrix: a2 ab ac ad b2 bc bd c2 cd d2 */
+struct Quadric {
+	double q[10];
+
+	Quadric()
+	{
+		for (int i = 0; i < 10; ++i)
+			q[i] = 0;
+	}
+
+	void add_plane(const vec3 &n, double d, double w)
+	{
+		q[0] += w * n.x * n.x;
+		q[1] += w * n.x * n.y;
+		q[2] += w * n.x * n.z;
+		q[3] += w * n.x * d;
+		q[4] += w * n.y * n.y;
+		q[5] += w * n.y * n.z;
+		q[6] += w * n.y * d;
+		q[7] += w * n.z * n.z;
+		q[8] += w * n.z * d;
+		q[9] += w * d * d;
+	}
+
+	void add(const Quadric &o)
+	{
+		for (int i = 0; i < 10; ++i)
+			q[i] += o.q[i];
+	}
+
+	double error(const vec3 &v) const
+	{
+		return q[0] * v.x * v.x + 2 * q[1] * v.x * v.y +
+		       2 * q[2] * v.x * v.z + 2 * q[3] * v.x +
+		       q[4] * v.y * v.y + 2 * q[5] * v.y * v.z +
+		       2 * q[6] * v.y + q[7] * v.z * v.z +
+		       2 * q[8] * v.z + q[9];
+	}
+};
+
+struct Collapse {
+	double cost;
+	size_t from, to;
+	unsigned from_version, to_version;
+
+	bool operator < (const Collapse &o) const
+	{
+		/* priority_queue pops the largest, we want the cheapest */
+		return cost > o.cost;
+	}
+};
+
+typedef std::priority_queue<Collapse> collapse_queue_t;
+typedef std::pair<size_t, size_t> edge_t;
+typedef std::map<edge_t, int> edge_map_t;
+
+edge_t make_edge(size_t a, size_t b)
+{
+	if (a > b)
+		std::swap(a, b);
+	return edge_t(a, b);
+}
+
+vec3 face_normal(const std::vector<vec3> &vertices, const Face *f)
+{
+	const vec3 &a = vertices[f->vert[0]];
+	return cross(vertices[f->vert[1]] - a, vertices[f->vert[2]] - a);
+}
+
+bool has_vertex(const Face *f, size_t v)
+{
+	return f->vert[0] == v || f->vert[1] == v || f->vert[2] == v;
+}
+
+class Simplifier {
+public:
+	Simplifier(std::vector<Face> *faces, const std::vector<vec3> &vertices) :
+		m_faces(faces),
+		m_vertices(vertices),
+		m_quadrics(vertices.size()),
+		m_version(vertices.size(), 0),
+		m_adjacent(vertices.size()),
+		m_alive(faces->size(), true),
+		m_num_alive(faces->size())
+	{
+	}
+
+	void run(size_t target);
+
+private:
+	std::vector<Face> *m_faces;
+	const std::vector<vec3> &m_vertices;
+	std::vector<Quadric> m_quadrics;
+	std::vector<unsigned> m_version;
+	std::vector<std::vector<size_t> > m_adjacent;
+	std::vector<bool> m_alive;
+	size_t m_num_alive;
+	collapse_queue_t m_queue;
+
+	void push(size_t from, size_t to)
+	{
+		Quadric q = m_quadrics[from];
+		q.add(m_quadrics[to]);
+		Collapse c;
+		c.cost = q.error(m_vertices[to]);
+		c.from = from;
+		c.to = to;
+		c.from_version = m_version[from];
+		c.to_version = m_version[to];
+		m_queue.push(c);
+	}
+
+	void push_neighbours(size_t v);
+	bool flips(size_t from, size_t to) const;
+	void collapse(size_t from, size_t to);
+};
+
+void Simplifier::push_neighbours(size_t v)
+{
+	FOR_EACH_CONST(std::vector<size_t>, i, m_adjacent[v]) {
+		if (!m_alive[*i])
+			continue;
+		const Face *f = &(*m_faces)[*i];
+		for (int j = 0; j < 3; ++j) {
+			if (f->vert[j] != v) {
+				push(v, f->vert[j]);
+				push(f->vert[j], v);
+			}
+		}
+	}
+}
+
+bool Simplifier::flips(size_t from, size_t to) const
+{
+	FOR_EACH_CONST(std::vector<size_t>, i, m_adjacent[from]) {
+		if (!m_alive[*i])
+			continue;
+		const Face *f = &(*m_faces)[*i];
+		if (has_vertex(f, to))
+			continue;
+		Face moved = *f;
+		for (int j = 0; j < 3; ++j) {
+			if (moved.vert[j] == from)
+				moved.vert[j] = to;
+		}
+		vec3 before = normalize(face_normal(m_vertices, f));
+		vec3 after = normalize(face_normal(m_vertices, &moved));
+		if (dot(before, after) < MIN_FLIP_DOT)
+			return true;
+	}
+	return false;
+}
+
+void Simplifier::collapse(size_t from, size_t to)
+{
+	FOR_EACH_CONST(std::vector<size_t>, i, m_adjacent[from]) {
+		if (!m_alive[*i])
+			continue;
+		Face *f = &(*m_faces)[*i];
+		if (has_vertex(f, to)) {
+			m_alive[*i] = false;
+			m_num_alive--;
+			continue;
+		}
+		/* the corner keeps its own normal, which suits flat shading */
+		for (int j = 0; j < 3; ++j) {
+			if (f->vert[j] == from)
+				f->vert[j] = to;
+		}
+		m_adjacent[to].push_back(*i);
+	}
+	m_adjacent[from].clear();
+	m_quadrics[to].add(m_quadrics[from]);
+	m_version[from]++;
+	m_version[to]++;
+	push_neighbours(to);
+}
+
+void Simplifier::run(size_t target)
+{
+	edge_map_t edges;
+	for (size_t i = 0; i < m_faces->size(); ++i) {
+		const Face *f = &(*m_faces)[i];
+		vec3 n = face_normal(m_vertices, f);
+		double area = length(n) * 0.5;
+		n = normalize(n);
+		double d = -dot(n, m_vertices[f->vert[0]]);
+		for (int j = 0; j < 3; ++j) {
+			m_quadrics[f->vert[j]].add_plane(n, d, area);
+			m_adjacent[f->vert[j]].push_back(i);
+			edges[make_edge(f->vert[j], f->vert[(j + 1) % 3])]++;
+		}
+	}
+
+	/* constrain edges which belong only to a single face */
+	for (size_t i = 0; i < m_faces->size(); ++i) {
+		const Face *f = &(*m_faces)[i];
+		vec3 n = normalize(face_normal(m_vertices, f));
+		for (int j = 0; j < 3; ++j) {
+			size_t a = f->vert[j], b = f->vert[(j + 1) % 3];
+			if (get(edges, make_edge(a, b)) != 1)
+				continue;
+			vec3 e = m_vertices[b] - m_vertices[a];
+			vec3 bn = normalize(cross(e, n));
+			double d = -dot(bn, m_vertices[a]);
+			double w = BOUNDARY_WEIGHT * dot(e, e);
+			m_quadrics[a].add_plane(bn, d, w);
+			m_quadrics[b].add_plane(bn, d, w);
+		}
+	}
+
+	FOR_EACH_CONST(edge_map_t, i, edges) {
+		push(i->first.first, i->first.second);
+		push(i->first.second, i->first.first);
+	}
+
+	while (m_num_alive > target && !m_queue.empty()) {
+		Collapse c = m_queue.top();
+		m_queue.pop();
+		if (c.from_version != m_version[c.from] ||
+		    c.to_version != m_version[c.to])
+			continue;
+		if (flips(c.from, c.to))
+			continue;
+		collapse(c.from, c.to);
+	}
+
+	std::vector<Face> out;
+	out.reserve(m_num_alive);
+	for (size_t i = 0; i < m_faces->size(); ++i) {
+		if (m_alive[i])
+			out.push_back((*m_faces)[i]);
+	}
+	m_faces->swap(out);
+}
+
+}
+
+void simplify_faces(std::vector<Face> *faces,
+		    const std::vector<vec3> &vertices, size_t target)
+{
+	if (faces->size() <= target)
+		return;
+	Simplifier simplifier(faces, vertices);
+	simplifier.run(target);
+}
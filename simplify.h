@@ -0,0 +1,9 @@
+#ifndef __simplify_h
+#define __simplify_h
+
+#include "gl.h"
+
+void simplify_faces(std::vector<Face> *faces,
+		    const std::vector<vec3> &vertices, size_t target);
+
+#endif
@@ -13,6 +13,7 @@
 #include "utils.h"
 #include "stage.h"
 #include "effects.h"
+#include "cpu.h"
 #include <stdexcept>
 #include <fstream>
 #include <sstream>
@@ -88,6 +89,60 @@ const BoneDef bonedefs[] = {
 	{RIGHT_HAND, LEFT_SHOULDER, 0, 0.2, 0},
 };
 
+/* Lays the attachments out for the skinning kernel */
+void build_skin(Skeleton *skeleton)
+{
+	std::map<const Bone *, int> bone_index;
+	int i = 0;
+	FOR_EACH_CONST(std::list<Bone>, bone, skeleton->bones) {
+		ins(bone_index, &*bone, i++);
+	}
+
+	size_t count = skeleton->vertices.size();
+	size_t slots = 0;
+	FOR_EACH_CONST(std::vector<SkelVertex>, v, skeleton->vertices) {
+		slots = std::max(slots, v->attach.size());
+	}
+	skeleton->skin.resize(slots);
+	FOR_EACH(std::vector<SkinSlot>, slot, skeleton->skin) {
+		slot->bone.assign(count, 0);
+		for (int j = 0; j < 7; ++j) {
+			slot->coef[j].assign(count, 0);
+		}
+	}
+
+	for (size_t v = 0; v < count; ++v) {
+		const std::vector<Attach> &attach =
+			skeleton->vertices[v].attach;
+		double sum = 0;
+		FOR_EACH_CONST(std::vector<Attach>, a, attach) {
+			sum += a->w;
+		}
+		if (sum <= 0)
+			continue;
+		for (size_t j = 0; j < attach.size(); ++j) {
+			const Attach *a = &attach[j];
+			SkinSlot *slot = &skeleton->skin[j];
+			slot->bone[v] = get(bone_index, (const Bone *) a->bone);
+			slot->coef[0][v] = a->x;
+			slot->coef[1][v] = a->u;
+			slot->coef[2][v] = a->v;
+			slot->coef[3][v] = a->nx;
+			slot->coef[4][v] = a->nu;
+			slot->coef[5][v] = a->nv;
+			slot->coef[6][v] = a->w / sum;
+		}
+	}
+
+	for (int j = 0; j < 12; ++j) {
+		skeleton->frame[j].assign(std::max(skeleton->bones.size(),
+						   size_t(1)), 0);
+	}
+	for (int j = 0; j < 6; ++j) {
+		skeleton->skinned[j].assign(count, 0);
+	}
+}
+
 }
 
 void reset_skeleton(Skeleton *skeleton, const vec3 &origo)
@@ -112,6 +167,7 @@ void load_skeleton(Skeleton *skeleton, const char *fname, const vec3 &origo)
 	skeleton->bones.clear();
 	skeleton->groups.clear();
 	skeleton->vertices.clear();
+	skeleton->skin.clear();
 
 	Mesh mesh;
 	load_mesh(&mesh, fname, 1.0, origo);
@@ -238,6 +294,7 @@ void load_skeleton(Skeleton *skeleton, const char *fname, const vec3 &origo)
 			attach->nv = dot(n, attach->bone->perp);
 		}
 	}
+	build_skin(skeleton);
 	debug("done. %zd bones\n", skeleton->bones.size());
 }
 
@@ -392,30 +449,40 @@ double apply_block(Skeleton *skeleton, const Block *block, double dt)
 	return hit;
 }
 
+/* Skinning runs on the kernels, one attachment slot at a time */
 void calc_posture(Skeleton *skeleton)
 {
-	FOR_EACH(std::vector<SkelVertex>, v, skeleton->vertices) {
-		vec3 pos(0, 0, 0);
-		vec3 normal(0, 0, 0);
-		double sum = 0;
-		FOR_EACH_CONST(std::vector<Attach>, attach, v->attach) {
-			const Bone *bone = attach->bone;
-			pos += (bone->a->pos +
-				bone->d * attach->x +
-				bone->up * attach->u +
-				bone->perp * attach->v) *
-				attach->w;
-			normal += (bone->d * attach->nx +
-				bone->up * attach->nu +
-				bone->perp * attach->nv) *
-				attach->w;
-			sum += attach->w;
+	size_t count = skeleton->vertices.size();
+	if (count == 0)
+		return;
+
+	size_t i = 0;
+	FOR_EACH_CONST(std::list<Bone>, bone, skeleton->bones) {
+		const vec3 *v[4] = {&bone->a->pos, &bone->d, &bone->up,
+				    &bone->perp};
+		for (int j = 0; j < 4; ++j) {
+			skeleton->frame[j * 3][i] = v[j]->x;
+			skeleton->frame[j * 3 + 1][i] = v[j]->y;
+			skeleton->frame[j * 3 + 2][i] = v[j]->z;
 		}
-		if (sum > 0) {
-			sum = 1.0 / sum;
-			v->pos = pos * sum;
-			v->normal = normal * sum;
+		i++;
+	}
+
+	const float *frame[12];
+	float *out[6];
+	for (int j = 0; j < 12; ++j) {
+		frame[j] = &skeleton->frame[j][0];
+	}
+	for (int j = 0; j < 6; ++j) {
+		skeleton->skinned[j].assign(count, 0);
+		out[j] = &skeleton->skinned[j][0];
+	}
+	FOR_EACH_CONST(std::vector<SkinSlot>, slot, skeleton->skin) {
+		const float *coef[7];
+		for (int j = 0; j < 7; ++j) {
+			coef[j] = &slot->coef[j][0];
 		}
+		kernels.skin(count, &slot->bone[0], frame, coef, out);
 	}
 }
 
@@ -433,14 +500,11 @@ void draw(const Skeleton *skeleton)
 			const Face *f = &group->faces[j];
 			for (int i = 0; i < 3; ++i) {
 				GLVertex gv;
-				vec3 p = skeleton->vertices[f->vert[i]].pos;
-				vec3 n = skeleton->vertices[f->vert[i]].normal;
-				gv.pos[0] = p.x;
-				gv.pos[1] = p.y;
-				gv.pos[2] = p.z;
-				gv.normal[0] = n.x;
-				gv.normal[1] = n.y;
-				gv.normal[2] = n.z;
+				size_t v = f->vert[i];
+				for (int c = 0; c < 3; ++c) {
+					gv.pos[c] = skeleton->skinned[c][v];
+					gv.normal[c] = skeleton->skinned[3 + c][v];
+				}
 				buf[j * 3 + i] = gv;
 			}
 		}
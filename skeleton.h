@@ -70,7 +70,13 @@ struct Attach {
 
 struct SkelVertex {
 	std::vector<Attach> attach;
-	vec3 pos, normal;
+};
+
+/* The nth attachment of every vertex, padded with zero weights */
+struct SkinSlot {
+	std::vector<int> bone;
+	/* x, u, v, nx, nu, nv and the normalized weight */
+	std::vector<float> coef[7];
 };
 
 struct Skeleton {
@@ -78,6 +84,11 @@ struct Skeleton {
 	std::vector<SkelVertex> vertices;
 	std::list<Bone> bones;
 	group_map_t groups;
+	std::vector<SkinSlot> skin;
+	/* a, d, up and perp of each bone, refreshed by calc_posture() */
+	std::vector<float> frame[12];
+	/* position and normal of each vertex */
+	std::vector<float> skinned[6];
 };
 
 struct Block;
@@ -3,10 +3,13 @@
  */
 #include "sound.h"
 #include "utils.h"
+#include "cpu.h"
+#include "loader.h"
 #include <vorbis/vorbisfile.h>
 #include <SDL.h>
 #include <list>
 #include <stdexcept>
+#include <string.h>
 
 namespace {
 
@@ -21,49 +24,229 @@ struct Playing {
 
 const int SAMPLERATE = 44100;
 
+/* Longer ones are streamed from the archive instead of decoded */
+const double MAX_PACKED_SOUND = 10;
+
 std::list<Playing> playing;
-OggVorbis_File music;
-FILE *music_file = NULL;
+
+struct MemoryFile {
+	const char *data;
+	size_t size, pos;
+};
+
+/* Streamed from the archive or a file */
+struct MusicStream {
+	std::string fname;
+	OggVorbis_File vf;
+	MemoryFile memory;
+};
+
+MusicStream *music = NULL;
+/* opened ahead by prepare_music() */
+MusicStream *next_music = NULL;
+
+size_t memory_read(void *ptr, size_t size, size_t nmemb, void *datasource)
+{
+	MemoryFile *f = (MemoryFile *) datasource;
+	size_t n = std::min(nmemb, (f->size - f->pos) / size);
+	memcpy(ptr, f->data + f->pos, n * size);
+	f->pos += n * size;
+	return n;
+}
+
+int memory_seek(void *datasource, ogg_int64_t offset, int whence)
+{
+	MemoryFile *f = (MemoryFile *) datasource;
+	ogg_int64_t pos;
+	switch (whence) {
+	case SEEK_SET:
+		pos = offset;
+		break;
+	case SEEK_CUR:
+		pos = f->pos + offset;
+		break;
+	case SEEK_END:
+		pos = f->size + offset;
+		break;
+	default:
+		return -1;
+	}
+	if (pos < 0 || pos > ogg_int64_t(f->size))
+		return -1;
+	f->pos = pos;
+	return 0;
+}
+
+long memory_tell(void *datasource)
+{
+	return ((MemoryFile *) datasource)->pos;
+}
+
+const ov_callbacks memory_callbacks = {
+	memory_read, memory_seek, NULL, memory_tell,
+};
+
+void decode_sound(std::vector<int16_t> *data, OggVorbis_File *vf,
+		  const char *fname)
+{
+	size_t pos = 0;
+	while (1) {
+		data->resize(pos + 4096);
+
+		int bitstream = 0;
+		long got = ov_read(vf, (char *) &(*data)[pos], 4096 * 2,
+				   0, 2, 1, &bitstream);
+		if (got <= 0) {
+			data->resize(pos);
+			break;
+		}
+		got /= 2;
+		data->resize(pos + got);
+		vorbis_info *vi = ov_info(vf, -1);
+		if (vi->channels != 2 || vi->rate != SAMPLERATE) {
+			throw std::runtime_error(strf("Invalid sound format: %s",
+						      fname));
+		}
+		pos += got;
+	}
+	debug("%zd samples\n", pos);
+}
+
+void open_vorbis(OggVorbis_File *vf, const char *fname)
+{
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) {
+		throw std::runtime_error(strf("Can not open %s", fname));
+	}
+	if (ov_open(f, vf, NULL, 0)) {
+		throw std::runtime_error(strf("Invalid vorbis file: %s",
+					      fname));
+	}
+}
+
+MusicStream *open_music(const char *fname)
+{
+	MusicStream *stream = new MusicStream;
+	stream->fname = fname;
+	try {
+		const Asset *asset = find_asset(fname, ASSET_FILE);
+		if (asset != NULL) {
+			stream->memory.data = asset->data;
+			stream->memory.size = asset->size;
+			stream->memory.pos = 0;
+			if (ov_open_callbacks(&stream->memory, &stream->vf, NULL,
+					      0, memory_callbacks)) {
+				throw std::runtime_error(
+					strf("Invalid vorbis file: %s", fname));
+			}
+		} else {
+			open_vorbis(&stream->vf, fname);
+		}
+	} catch (...) {
+		delete stream;
+		throw;
+	}
+	return stream;
+}
+
+void close_music(MusicStream *stream)
+{
+	ov_clear(&stream->vf);
+	delete stream;
+}
+
+class MusicJob;
+
+/* Until it has finished */
+MusicJob *music_job = NULL;
+
+class MusicJob : public LoadJob {
+public:
+	MusicJob(const char *fname) :
+		m_fname(fname), m_stream(NULL)
+	{}
+
+	~MusicJob()
+	{
+		if (m_stream != NULL) {
+			close_music(m_stream);
+		}
+	}
+
+	const std::string &fname() const { return m_fname; }
+
+	void load() { m_stream = open_music(m_fname.c_str()); }
+
+	void finish()
+	{
+		if (next_music != NULL) {
+			close_music(next_music);
+		}
+		next_music = m_stream;
+		m_stream = NULL;
+		music_job = NULL;
+	}
+
+private:
+	std::string m_fname;
+	MusicStream *m_stream;
+};
+
+/* The sound is only touched on the main thread */
+class SoundJob : public LoadJob {
+public:
+	SoundJob(Sound *sound, const char *fname) :
+		m_sound(sound), m_fname(fname)
+	{}
+
+	void load() { load_sound(&m_loaded, m_fname.c_str()); }
+
+	void finish()
+	{
+		/* the samples stay where they are */
+		m_sound->data.swap(m_loaded.data);
+		m_sound->samples = m_loaded.samples;
+		m_sound->length = m_loaded.length;
+	}
+
+private:
+	Sound *m_sound;
+	std::string m_fname;
+	Sound m_loaded;
+};
 
 void fill_audio(void *userdata, Uint8 *_buf, int _len)
 {
 	size_t len = _len / 2;
 	int16_t *buf = (int16_t *) _buf;
 
-	for (size_t i = 0; i < len;) {
+	if (music == NULL) {
+		memset(buf, 0, len * 2);
+	}
+	for (size_t i = 0; music != NULL && i < len;) {
 		int bitstream = 0;
-		long got = ov_read(&music, (char *) &buf[i],
+		long got = ov_read(&music->vf, (char *) &buf[i],
 				   (len - i) * 2, 0, 2, 1, &bitstream);
 		if (got == OV_HOLE) {
 			continue;
 		}
 		if (got <= 0) {
-			ov_time_seek(&music, 0);
+			ov_time_seek(&music->vf, 0);
 			continue;
 		}
 		got /= 2;
-		vorbis_info *vi = ov_info(&music, -1);
+		vorbis_info *vi = ov_info(&music->vf, -1);
 		assert(vi->channels == 2);
 		assert(vi->rate == SAMPLERATE);
 		i += got;
 	}
 
 	FOR_EACH_SAFE(std::list<Playing>, p, playing) {
-		size_t chunk = std::min(p->sound->data.size() - p->pos, len);
-		const int16_t *data = p->sound->data.data();
-		if (p->volume != 1) {
-			int s = p->volume * 256.0;
-			for (size_t i = 0; i < chunk; ++i) {
-				int output = buf[i] + data[p->pos++] * s / 256;
-				buf[i] = std::max(std::min(output, 0x7FFF), -0x8000);
-			}
-		} else {
-			for (size_t i = 0; i < chunk; ++i) {
-				int output = buf[i] + data[p->pos++];
-				buf[i] = std::max(std::min(output, 0x7FFF), -0x8000);
-			}
-		}
-		if (p->pos >= p->sound->data.size()) {
+		size_t chunk = std::min(p->sound->length - p->pos, len);
+		kernels.mix_audio(buf, p->sound->samples + p->pos, chunk,
+				  int(p->volume * 256.0));
+		p->pos += chunk;
+		if (p->pos >= p->sound->length) {
 			playing.erase(p);
 		}
 	}
@@ -81,26 +264,58 @@ double get_music_time()
 
 void play_music(const char *fname)
 {
-	SDL_LockAudio();
-	if (music_file != NULL) {
-		ov_clear(&music);
-	}
-	music_file = fopen(fname, "rb");
-	if (music_file == NULL) {
-		throw std::runtime_error(strf("Can not open %s", fname));
+	/* rather than opening it twice */
+	while (music_job != NULL && music_job->fname() == fname &&
+	       finish_load()) {
 	}
-	if (ov_open(music_file, &music, NULL, 0)) {
-		throw std::runtime_error(strf("Invalid vorbis file: %s",
-					      fname));
+	MusicStream *stream;
+	if (next_music != NULL && next_music->fname == fname) {
+		stream = next_music;
+		next_music = NULL;
+	} else {
+		stream = open_music(fname);
 	}
+
+	SDL_LockAudio();
+	MusicStream *prev = music;
+	music = stream;
 	music_pos = 0;
 	music_time = SDL_GetTicks();
 	SDL_UnlockAudio();
+	if (prev != NULL) {
+		close_music(prev);
+	}
 	SDL_PauseAudio(0);
 }
 
+void prepare_music(const char *fname)
+{
+	if (next_music != NULL && next_music->fname == fname)
+		return;
+	if (music_job != NULL && music_job->fname() == fname)
+		return;
+	cancel_music();
+	debug("queuing %s\n", fname);
+	music_job = new MusicJob(fname);
+	start_load(music_job);
+}
+
+void cancel_music()
+{
+	if (music_job != NULL) {
+		music_job->cancel();
+		music_job = NULL;
+	}
+	if (next_music != NULL) {
+		close_music(next_music);
+		next_music = NULL;
+	}
+}
+
 void play_sound(const Sound *sound, double volume)
 {
+	if (sound->empty())
+		return;
 	Playing p;
 	p.sound = sound;
 	p.pos = 0;
@@ -110,40 +325,58 @@ void play_sound(const Sound *sound, double volume)
 	SDL_UnlockAudio();
 }
 
+void stop_sound(const Sound *sound)
+{
+	SDL_LockAudio();
+	FOR_EACH_SAFE(std::list<Playing>, p, playing) {
+		if (p->sound == sound) {
+			playing.erase(p);
+		}
+	}
+	SDL_UnlockAudio();
+}
+
 void load_sound(Sound *sound, const char *fname)
 {
 	debug("loading %s\n", fname);
-	FILE *f = fopen(fname, "rb");
-	if (f == NULL) {
-		throw std::runtime_error(strf("Can not open %s", fname));
+	const Asset *asset = find_asset(fname, ASSET_SOUND);
+	if (asset != NULL) {
+		AssetReader reader(asset);
+		sound->length = reader.get<uint32_t>();
+		sound->samples = (const int16_t *)
+			reader.skip(sound->length * sizeof(int16_t));
+		return;
 	}
 	OggVorbis_File vf;
-	if (ov_open(f, &vf, NULL, 0)) {
-		throw std::runtime_error(strf("Invalid vorbis file: %s",
-					      fname));
-	}
-	size_t pos = 0;
-	while (1) {
-		sound->data.resize(pos + 4096);
+	open_vorbis(&vf, fname);
+	decode_sound(&sound->data, &vf, fname);
+	ov_clear(&vf);
+	sound->samples = sound->data.empty() ? NULL : &sound->data[0];
+	sound->length = sound->data.size();
+}
 
-		int bitstream = 0;
-		long got = ov_read(&vf, (char *) &sound->data[pos], 4096 * 2,
-				   0, 2, 1, &bitstream);
-		if (got <= 0) {
-			sound->data.resize(pos);
-			break;
-		}
-		got /= 2;
-		sound->data.resize(pos + got);
-		vorbis_info *vi = ov_info(&vf, -1);
-		if (vi->channels != 2 || vi->rate != SAMPLERATE) {
-			throw std::runtime_error(strf("Invalid sound format: %s",
-						      fname));
-		}
-		pos += got;
+void load_sound_async(Sound *sound, const char *fname)
+{
+	debug("queuing %s\n", fname);
+	start_load(new SoundJob(sound, fname));
+}
+
+void pack_sound(const char *fname, AssetType *type, std::string *out)
+{
+	OggVorbis_File vf;
+	open_vorbis(&vf, fname);
+	if (ov_time_total(&vf, -1) > MAX_PACKED_SOUND) {
+		ov_clear(&vf);
+		*type = ASSET_FILE;
+		*out = read_file(fname);
+		return;
 	}
-	debug("%zd samples\n", pos);
+	std::vector<int16_t> data;
+	decode_sound(&data, &vf, fname);
 	ov_clear(&vf);
+	*type = ASSET_SOUND;
+	put(out, uint32_t(data.size()));
+	out->append((const char *) &data[0], data.size() * sizeof(int16_t));
 }
 
 void init_sound()
@@ -1,17 +1,39 @@
 #ifndef __sound_h
 #define __sound_h
 
+#include "archive.h"
 #include <stdint.h>
 #include <vector>
 
 struct Sound {
+	/* points to data, or into the archive */
+	const int16_t *samples;
+	size_t length;
 	std::vector<int16_t> data;
+
+	Sound() :
+		samples(NULL), length(0)
+	{}
+
+	bool empty() const { return length == 0; }
+
+	DISABLE_COPY_AND_ASSIGN(Sound);
 };
 
 double get_music_time();
 void play_music(const char *fname);
+/* Opens it on a loader thread, for a later play_music() */
+void prepare_music(const char *fname);
+/* Closes the prepared one, or drops the job still opening it */
+void cancel_music();
 void play_sound(const Sound *sound, double volume=1);
+/* Before the sound is freed */
+void stop_sound(const Sound *sound);
 void load_sound(Sound *sound, const char *fname);
+/* Plays as silence until the loader threads are done with it */
+void load_sound_async(Sound *sound, const char *fname);
+/* Short sounds are stored decoded, music as it is for streaming */
+void pack_sound(const char *fname, AssetType *type, std::string *out);
 void init_sound();
 
 #endif
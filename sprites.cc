@@ -0,0 +1,253 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * UI texture atlas and sprite batching
+ */
+#include "sprites.h"
+#include "utils.h"
+#include "loader.h"
+#include <algorithm>
+#include <stdexcept>
+#include <string.h>
+
+SpriteBatch sprite_batch;
+
+namespace {
+
+const char *ui_images[] = {
+	"bar.png", "camera.png", "cursor.png", "digits.png", "excellent.png",
+	"good.png", "tryagain.png", "standup.png", "logo.png", "help.png",
+	"highscores.png", "score.png", "nextlevel.png", "menu_play.png",
+	"menu_freeplay.png", "menu_highscores.png", "menu_help.png",
+	"menu_credits.png", "menu_quit.png", "lefthand.png", "righthand.png",
+	"leftfoot.png", "rightfoot.png", "head.png", "jump.png",
+	"turnleft.png", "turnright.png", "flip.png",
+};
+
+const int ATLAS_WIDTH = 2048;
+
+/* Transparent gap between pictures, keeps the mipmaps apart */
+const int ATLAS_PADDING = 4;
+const int ATLAS_MAX_LEVEL = 2;
+
+std::map<std::string, Sprite> sprites;
+bool atlas_loading = false;
+
+struct AtlasLayout {
+	Image atlas;
+	std::vector<int> x, y, width, height;
+};
+
+bool taller(const Image *a, const Image *b)
+{
+	if (a->height != b->height)
+		return a->height > b->height;
+	return a->width > b->width;
+}
+
+/* Shelves of pictures, tallest first. No GL */
+void pack_atlas(AtlasLayout *layout)
+{
+	std::vector<Image> images(ARRAY_SIZE(ui_images));
+	std::vector<const Image *> order;
+	for (size_t i = 0; i < images.size(); ++i) {
+		load_image(&images[i], ui_images[i]);
+		if (images[i].format != GL_RGBA) {
+			throw std::runtime_error(strf("Not RGBA: %s",
+						      ui_images[i]));
+		}
+		order.push_back(&images[i]);
+	}
+	std::stable_sort(order.begin(), order.end(), taller);
+
+	std::vector<int> &x = layout->x, &y = layout->y;
+	x.resize(images.size());
+	y.resize(images.size());
+	int shelf_x = 0, shelf_y = 0, shelf_height = 0;
+	FOR_EACH_CONST(std::vector<const Image *>, i, order) {
+		const Image *image = *i;
+		if (shelf_x + image->width > ATLAS_WIDTH) {
+			shelf_x = 0;
+			shelf_y += shelf_height + ATLAS_PADDING;
+			shelf_height = 0;
+		}
+		size_t index = image - &images[0];
+		x[index] = shelf_x;
+		y[index] = shelf_y;
+		shelf_x += image->width + ATLAS_PADDING;
+		shelf_height = std::max(shelf_height, image->height);
+	}
+
+	Image &atlas = layout->atlas;
+	atlas.width = ATLAS_WIDTH;
+	atlas.height = 1;
+	while (atlas.height < shelf_y + shelf_height) {
+		atlas.height *= 2;
+	}
+	atlas.format = GL_RGBA;
+	atlas.pixels.assign(atlas.width * atlas.height * 4, 0);
+	for (size_t i = 0; i < images.size(); ++i) {
+		const Image *image = &images[i];
+		for (int row = 0; row < image->height; ++row) {
+			size_t offset = (y[i] + row) * atlas.width + x[i];
+			memcpy(&atlas.pixels[offset * 4],
+			       &image->pixels[row * image->width * 4],
+			       image->width * 4);
+		}
+		layout->width.push_back(image->width);
+		layout->height.push_back(image->height);
+	}
+	debug("UI atlas %d x %d\n", atlas.width, atlas.height);
+}
+
+void upload_atlas(const AtlasLayout *layout)
+{
+	const Image &atlas = layout->atlas;
+	GLuint texture = upload_texture(&atlas);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, ATLAS_MAX_LEVEL);
+
+	for (size_t i = 0; i < ARRAY_SIZE(ui_images); ++i) {
+		int x = layout->x[i], y = layout->y[i];
+		Sprite sprite;
+		sprite.texture = texture;
+		sprite.s0 = float(x) / atlas.width;
+		sprite.t0 = float(y) / atlas.height;
+		sprite.s1 = float(x + layout->width[i]) / atlas.width;
+		sprite.t1 = float(y + layout->height[i]) / atlas.height;
+		sprite.width = layout->width[i];
+		sprite.height = layout->height[i];
+		ins(sprites, std::string(ui_images[i]), sprite);
+	}
+}
+
+class AtlasJob : public LoadJob {
+public:
+	AtlasJob() {}
+
+	void load() { pack_atlas(&m_layout); }
+
+	void finish()
+	{
+		upload_atlas(&m_layout);
+		atlas_loading = false;
+	}
+
+private:
+	AtlasLayout m_layout;
+};
+
+}
+
+void load_sprites_async()
+{
+	if (!sprites.empty() || atlas_loading)
+		return;
+	atlas_loading = true;
+	start_load(new AtlasJob);
+}
+
+const Sprite *get_sprite(const char *fname)
+{
+	if (atlas_loading) {
+		finish_all_loads();
+	}
+	if (sprites.empty()) {
+		AtlasLayout layout;
+		pack_atlas(&layout);
+		upload_atlas(&layout);
+	}
+	std::map<std::string, Sprite>::const_iterator i = sprites.find(fname);
+	if (i == sprites.end()) {
+		throw std::runtime_error(strf("Not in the UI atlas: %s", fname));
+	}
+	return &i->second;
+}
+
+bool SpriteBatch::draws_before(const Quad &a, const Quad &b)
+{
+	if (a.blend != b.blend)
+		return a.blend < b.blend;
+	return a.texture < b.texture;
+}
+
+void SpriteBatch::draw(const Sprite *sprite, const vec2 &pos,
+		       const vec2 &size, const Color &color, BlendMode blend)
+{
+	draw_part(sprite, pos, size, color, 0, 0, 1, 1, blend);
+}
+
+void SpriteBatch::draw_part(const Sprite *sprite, const vec2 &pos,
+			    const vec2 &size, const Color &color, double s0,
+			    double t0, double s1, double t1, BlendMode blend)
+{
+	const double corners[4][2] = {{0, 0}, {0, 1}, {1, 1}, {1, 0}};
+	float sw = sprite->s1 - sprite->s0, th = sprite->t1 - sprite->t0;
+
+	Quad quad;
+	quad.blend = blend;
+	quad.texture = sprite->texture;
+	for (int i = 0; i < 4; ++i) {
+		Vertex *v = &quad.v[i];
+		double cx = corners[i][0], cy = corners[i][1];
+		v->x = pos.x + size.x * cx;
+		v->y = pos.y + size.y * cy;
+		v->s = sprite->s0 + sw * (s0 + (s1 - s0) * cx);
+		v->t = sprite->t0 + th * (t0 + (t1 - t0) * cy);
+		v->color[0] = color.r;
+		v->color[1] = color.g;
+		v->color[2] = color.b;
+		v->color[3] = color.a;
+	}
+	m_quads.push_back(quad);
+}
+
+void SpriteBatch::flush()
+{
+	if (m_quads.empty())
+		return;
+
+	std::stable_sort(m_quads.begin(), m_quads.end(), draws_before);
+	m_vertices.clear();
+	FOR_EACH_CONST(std::vector<Quad>, quad, m_quads) {
+		m_vertices.insert(m_vertices.end(), quad->v, quad->v + 4);
+	}
+
+	GLState state;
+	state.enable(GL_BLEND);
+	state.enable(GL_TEXTURE_2D);
+
+	GLClientState client_state;
+	client_state.enable(GL_VERTEX_ARRAY);
+	client_state.enable(GL_TEXTURE_COORD_ARRAY);
+	client_state.enable(GL_COLOR_ARRAY);
+	glVertexPointer(2, GL_FLOAT, sizeof(Vertex), &m_vertices[0].x);
+	glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), &m_vertices[0].s);
+	glColorPointer(4, GL_FLOAT, sizeof(Vertex), m_vertices[0].color);
+
+	size_t start = 0;
+	while (start < m_quads.size()) {
+		size_t end = start + 1;
+		while (end < m_quads.size() &&
+		       !draws_before(m_quads[start], m_quads[end]))
+			end++;
+
+		if (m_quads[start].blend == BLEND_ADD) {
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+		} else {
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		}
+		glBindTexture(GL_TEXTURE_2D, m_quads[start].texture);
+		glDrawArrays(GL_QUADS, start * 4, (end - start) * 4);
+		start = end;
+	}
+	m_quads.clear();
+
+	/* the color array leaves the current color undefined */
+	glColor4f(1, 1, 1, 1);
+}
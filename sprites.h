@@ -0,0 +1,62 @@
+#ifndef __sprites_h
+#define __sprites_h
+
+#include "gl.h"
+
+/* A rectangle of the UI atlas */
+struct Sprite {
+	GLuint texture;
+	float s0, t0, s1, t1;
+	int width, height;
+};
+
+enum BlendMode {
+	BLEND_ALPHA,
+	BLEND_ADD,
+};
+
+/* All UI pictures are packed into one texture on the first call */
+const Sprite *get_sprite(const char *fname);
+/* Packs them on a loader thread instead, get_sprite() waits for it */
+void load_sprites_async();
+
+/*
+ * Collects 2D quads and draws them with one call per blend mode and
+ * texture. Quads are drawn in the order they were added within a group.
+ * Uses the current matrices when flushed.
+ */
+class SpriteBatch {
+public:
+	SpriteBatch() {}
+
+	void draw(const Sprite *sprite, const vec2 &pos, const vec2 &size,
+		  const Color &color, BlendMode blend=BLEND_ALPHA);
+	/* Part of the sprite, coordinates are fractions of its size */
+	void draw_part(const Sprite *sprite, const vec2 &pos, const vec2 &size,
+		       const Color &color, double s0, double t0, double s1,
+		       double t1, BlendMode blend=BLEND_ALPHA);
+	void flush();
+
+private:
+	struct Vertex {
+		float x, y, s, t;
+		float color[4];
+	};
+
+	struct Quad {
+		BlendMode blend;
+		GLuint texture;
+		Vertex v[4];
+	};
+
+	std::vector<Quad> m_quads;
+	std::vector<Vertex> m_vertices;
+
+	static bool draws_before(const Quad &a, const Quad &b);
+
+	DISABLE_COPY_AND_ASSIGN(SpriteBatch);
+};
+
+extern SpriteBatch sprite_batch;
+
+#endif
@@ -4,6 +4,15 @@
 #include "utils.h"
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdexcept>
+#include <sys/time.h>
+#ifdef _WIN32
+#include <io.h>
+#define make_dir(name)	mkdir(name)
+#else
+#include <sys/stat.h>
+#define make_dir(name)	mkdir(name, 0755)
+#endif
 
 std::string strf(const char *fmt, ...)
 {
@@ -17,8 +26,164 @@ std::string strf(const char *fmt, ...)
 	return s;
 }
 
+namespace {
+
+struct RandomState {
+	uint64_t s[4];
+	bool seeded;
+};
+
+const char *CACHE_DIR = "cache";
+
+uint64_t random_seed = 0;
+__thread RandomState thread_random;
+
+uint64_t rotl(uint64_t x, int k)
+{
+	return (x << k) | (x >> (64 - k));
+}
+
+uint64_t next(RandomState *r)
+{
+	uint64_t result = rotl(r->s[1] * 5, 7) * 9;
+	uint64_t t = r->s[1] << 17;
+	r->s[2] ^= r->s[0];
+	r->s[3] ^= r->s[1];
+	r->s[1] ^= r->s[2];
+	r->s[0] ^= r->s[3];
+	r->s[2] ^= t;
+	r->s[3] = rotl(r->s[3], 45);
+	return result;
+}
+
+/*
+ * splitmix64 spreads the seed over the whole state. Stream n starts from
+ * the four outputs after those of stream n - 1, so every stream gets its
+ * own state at no cost per stream.
+ */
+void init(RandomState *r, uint64_t seed, unsigned stream)
+{
+	seed += 4 * 0x9e3779b97f4a7c15ULL * stream;
+	for (int i = 0; i < 4; ++i) {
+		seed += 0x9e3779b97f4a7c15ULL;
+		uint64_t z = seed;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		r->s[i] = z ^ (z >> 31);
+	}
+	r->seeded = true;
+}
+
+RandomState *get_state()
+{
+	RandomState *r = &thread_random;
+	if (!r->seeded) {
+		init(r, random_seed, 0);
+	}
+	return r;
+}
+
+}
+
+/* Also reseeds the calling thread as stream 0 */
+void seed_random(uint64_t seed)
+{
+	random_seed = seed;
+	init(&thread_random, seed, 0);
+}
+
+void seed_thread_random(unsigned stream)
+{
+	init(&thread_random, random_seed, stream);
+}
+
+uint64_t random_u64()
+{
+	return next(get_state());
+}
+
 double uniform()
 {
-	return rand() / (RAND_MAX + 1.0) +
-	       rand() / ((RAND_MAX + 1.0) * RAND_MAX);
+	/* top 53 bits fill the mantissa exactly */
+	return (next(get_state()) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void uniform_fill(float *out, size_t count)
+{
+	RandomState *r = get_state();
+	size_t i = 0;
+	for (; i + 2 <= count; i += 2) {
+		uint64_t x = next(r);
+		out[i] = (x >> 40) * (1.0f / 16777216.0f);
+		out[i + 1] = ((x >> 8) & 0xffffff) * (1.0f / 16777216.0f);
+	}
+	if (i < count) {
+		out[i] = (next(r) >> 40) * (1.0f / 16777216.0f);
+	}
+}
+
+uint64_t fnv1a(const void *data, size_t len, uint64_t hash)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ p[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+std::string read_file(const char *fname)
+{
+	FILE *f = fopen(fname, "rb");
+	if (f == NULL) {
+		throw std::runtime_error(strf("Can not open: %s", fname));
+	}
+	std::string data;
+	char buf[4096];
+	size_t len;
+	while ((len = fread(buf, 1, sizeof buf, f)) > 0) {
+		data.append(buf, len);
+	}
+	fclose(f);
+	return data;
+}
+
+bool write_file(const char *fname, const std::string &data)
+{
+	FILE *f = fopen(fname, "wb");
+	if (f == NULL)
+		return false;
+	bool ok = fwrite(data.data(), data.size(), 1, f) == 1;
+	if (fclose(f))
+		ok = false;
+	if (!ok) {
+		remove(fname);
+	}
+	return ok;
+}
+
+double wall_time()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+void startup_trace(const char *phase)
+{
+	static double start = 0, prev = 0;
+	double now = wall_time();
+	if (start == 0) {
+		start = now;
+		prev = now;
+	}
+	debug("startup: %-12s %6.1f ms, %6.1f ms total\n", phase,
+	      (now - prev) * 1000, (now - start) * 1000);
+	prev = now;
+}
+
+std::string cache_file(const std::string &name)
+{
+	/* fails harmlessly if it exists */
+	make_dir(CACHE_DIR);
+	return std::string(CACHE_DIR) + "/" + name;
 }
@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <string>
 #include <math.h>
+#include <stdint.h>
 
 extern bool debug_enabled;
 
@@ -67,7 +68,39 @@ Value &get(std::map<Key, Value> &map, const Key &key)
 }
 
 std::string strf(const char *fmt, ...);
+
+/*
+ * xoshiro256** generator. Every thread has its own state, and each stream
+ * of a seed starts from its own state, so the same seed always gives the
+ * same numbers. The main thread is stream 0. Which thread runs a loader
+ * job is not deterministic, so the loader reseeds before each job with a
+ * stream from the job's queue order; other worker threads must not draw
+ * numbers.
+ */
+const unsigned LOADER_RANDOM_STREAM = 1;
+
+void seed_random(uint64_t seed);
+void seed_thread_random(unsigned stream);
+uint64_t random_u64();
 double uniform();
+/* Fills with floats in [0, 1), cheaper than calling uniform() */
+void uniform_fill(float *out, size_t count);
+
+/* 64-bit FNV-1a, pass the previous hash to continue it */
+uint64_t fnv1a(const void *data, size_t len,
+	       uint64_t hash=0xcbf29ce484222325ULL);
+
+std::string read_file(const char *fname);
+/* Does not leave a truncated file behind */
+bool write_file(const char *fname, const std::string &data);
+
+/* Seconds, for measuring intervals */
+double wall_time();
+/* With -debug, the time the phase took. The first call starts the clock */
+void startup_trace(const char *phase);
+
+/* Path for a file of generated data, which can be deleted any time */
+std::string cache_file(const std::string &name);
 
 template<class T>
 class Animator {
@@ -30,6 +30,10 @@ struct Plane {
 	double d;
 };
 
+struct AABB {
+	vec3 min, max;
+};
+
 extern inline vec3 operator + (const vec3 &a, const vec3 &b)
 {
 	return vec3(a.x + b.x, a.y + b.y, a.z + b.z);
@@ -0,0 +1,187 @@
+/*
+ * SEKO
+ *
+ * Copyright 2012 Janne Kulmala <janne.t.kulmala@iki.fi>,
+ * Antti Rajamki <amikaze@gmail.com>
+ *
+ * Program code and resources are licensed with GNU LGPL 2.1. See
+ * COPYING.LGPL file.
+ *
+ * Tom Forsyth's linear-speed vertex cache optimisation
+ */
+#include "vertexcache.h"
+#include "utils.h"
+#include <algorithm>
+
+namespace {
+
+/* Modelled LRU cache, a few more than any real FIFO */
+const int CACHE_SIZE = 32;
+const double CACHE_DECAY_POWER = 1.5;
+const double LAST_TRI_SCORE = 0.75;
+const double VALENCE_BOOST_SCALE = 2.0;
+const double VALENCE_BOOST_POWER = 0.5;
+
+struct Vertex {
+	int cache_pos;
+	double score;
+	/* triangles not yet emitted are first in the list */
+	size_t first_tri, num_active;
+};
+
+struct Triangle {
+	double score;
+	bool added;
+};
+
+double vertex_score(const Vertex *v)
+{
+	if (v->num_active == 0)
+		return -1;
+
+	double score = 0;
+	if (v->cache_pos < 0) {
+		/* not in the cache */
+	} else if (v->cache_pos < 3) {
+		/* used by the last triangle, which gives no win */
+		score = LAST_TRI_SCORE;
+	} else {
+		double scale = 1.0 / (CACHE_SIZE - 3);
+		score = pow(1 - (v->cache_pos - 3) * scale, CACHE_DECAY_POWER);
+	}
+	/* finish off vertices with few triangles left */
+	return score + VALENCE_BOOST_SCALE *
+	       pow(v->num_active, -VALENCE_BOOST_POWER);
+}
+
+}
+
+void optimize_vertex_cache(std::vector<unsigned> *indices, size_t num_vertices)
+{
+	size_t num_tris = indices->size() / 3;
+	if (num_tris == 0)
+		return;
+
+	std::vector<Vertex> verts(num_vertices);
+	for (size_t i = 0; i < num_vertices; ++i) {
+		verts[i].cache_pos = -1;
+		verts[i].num_active = 0;
+	}
+	FOR_EACH_CONST(std::vector<unsigned>, i, *indices) {
+		verts[*i].num_active++;
+	}
+	size_t offset = 0;
+	for (size_t i = 0; i < num_vertices; ++i) {
+		verts[i].first_tri = offset;
+		offset += verts[i].num_active;
+		verts[i].num_active = 0;
+	}
+	std::vector<size_t> vert_tris(indices->size());
+	for (size_t t = 0; t < num_tris; ++t) {
+		for (int j = 0; j < 3; ++j) {
+			Vertex *v = &verts[(*indices)[t * 3 + j]];
+			vert_tris[v->first_tri + v->num_active++] = t;
+		}
+	}
+	for (size_t i = 0; i < num_vertices; ++i) {
+		verts[i].score = vertex_score(&verts[i]);
+	}
+
+	std::vector<Triangle> tris(num_tris);
+	for (size_t t = 0; t < num_tris; ++t) {
+		tris[t].added = false;
+		tris[t].score = 0;
+		for (int j = 0; j < 3; ++j) {
+			tris[t].score += verts[(*indices)[t * 3 + j]].score;
+		}
+	}
+
+	std::vector<unsigned> out;
+	out.reserve(indices->size());
+	std::vector<unsigned> cache, new_cache;
+	size_t best = num_tris;
+	size_t scan_pos = 0;
+	while (out.size() < indices->size()) {
+		if (best == num_tris) {
+			/* nothing in the cache helps, take the best of the rest */
+			double best_score = -1;
+			for (size_t t = scan_pos; t < num_tris; ++t) {
+				if (!tris[t].added && tris[t].score > best_score) {
+					best_score = tris[t].score;
+					best = t;
+				}
+			}
+			while (scan_pos < num_tris - 1 && tris[scan_pos].added)
+				scan_pos++;
+		}
+
+		const unsigned *tri = &(*indices)[best * 3];
+		tris[best].added = true;
+		new_cache.clear();
+		for (int j = 0; j < 3; ++j) {
+			out.push_back(tri[j]);
+			new_cache.push_back(tri[j]);
+
+			/* move the triangle out of the active part */
+			Vertex *v = &verts[tri[j]];
+			size_t *list = &vert_tris[v->first_tri];
+			size_t k = std::find(list, list + v->num_active, best) -
+				   list;
+			std::swap(list[k], list[v->num_active - 1]);
+			v->num_active--;
+		}
+		FOR_EACH_CONST(std::vector<unsigned>, i, cache) {
+			if (*i != tri[0] && *i != tri[1] && *i != tri[2])
+				new_cache.push_back(*i);
+		}
+		cache.swap(new_cache);
+
+		for (size_t i = 0; i < cache.size(); ++i) {
+			Vertex *v = &verts[cache[i]];
+			v->cache_pos = i < size_t(CACHE_SIZE) ? i : -1;
+			v->score = vertex_score(v);
+		}
+
+		best = num_tris;
+		double best_score = -1;
+		FOR_EACH_CONST(std::vector<unsigned>, i, cache) {
+			const Vertex *v = &verts[*i];
+			for (size_t k = 0; k < v->num_active; ++k) {
+				size_t t = vert_tris[v->first_tri + k];
+				Triangle *other = &tris[t];
+				other->score = 0;
+				for (int j = 0; j < 3; ++j) {
+					other->score +=
+						verts[(*indices)[t * 3 + j]].score;
+				}
+				if (other->score > best_score) {
+					best_score = other->score;
+					best = t;
+				}
+			}
+		}
+		if (cache.size() > size_t(CACHE_SIZE)) {
+			cache.resize(CACHE_SIZE);
+		}
+	}
+	indices->swap(out);
+}
+
+double cache_miss_ratio(const std::vector<unsigned> &indices,
+			size_t cache_size)
+{
+	if (indices.empty())
+		return 0;
+	std::vector<unsigned> fifo;
+	size_t misses = 0;
+	FOR_EACH_CONST(std::vector<unsigned>, i, indices) {
+		if (std::find(fifo.begin(), fifo.end(), *i) != fifo.end())
+			continue;
+		misses++;
+		fifo.push_back(*i);
+		if (fifo.size() > cache_size) {
+			fifo.erase(fifo.begin());
+		}
+	}
+	return misses * 3.0 / indices.size();
+}
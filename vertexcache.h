@@ -0,0 +1,14 @@
+#ifndef __vertexcache_h
+#define __vertexcache_h
+
+#include <vector>
+#include <stddef.h>
+
+/* Reorders triangles so that shared vertices are reused while cached */
+void optimize_vertex_cache(std::vector<unsigned> *indices, size_t num_vertices);
+
+/* Average cache misses per triangle for a FIFO cache of the given size */
+double cache_miss_ratio(const std::vector<unsigned> &indices,
+			size_t cache_size);
+
+#endif
@@ -15,6 +15,7 @@
 #include "stage.h"
 #include "sound.h"
 #include "gl.h"
+#include "resources.h"
 
 std::list<Zombie> zombies;
 
@@ -22,6 +23,11 @@ namespace {
 
 const vec3 zero(0, 0, 0);
 
+ModelHandle luxzombie;
+/* bounds of the model under any rotation around its pivot */
+double radius = 0;
+SoundHandle zombiesound[2];
+
 void apply_block(Zombie *zombie, const Block *block)
 {
 	vec3 nearest = zombie->pos;
@@ -92,14 +98,32 @@ Zombie *get_selected_zombie()
 	return nearest;
 }
 
-void move_zombies(const vec3 &player, double dt)
+/* Once, they stay loaded */
+void load_zombies()
 {
-	static Sound zombiesound[2];
-	if (zombiesound[0].data.empty()) {
-		load_sound(&zombiesound[0], "zombie1.ogg");
-		load_sound(&zombiesound[1], "zombie2.ogg");
-	}
+	if (!luxzombie.empty())
+		return;
+	luxzombie = get_model("luxzombie.obj", 2);
+	zombiesound[0] = get_sound("zombie1.ogg");
+	zombiesound[1] = get_sound("zombie2.ogg");
+}
 
+void release_zombies()
+{
+	luxzombie = ModelHandle();
+	zombiesound[0] = SoundHandle();
+	zombiesound[1] = SoundHandle();
+}
+
+void wait_zombies()
+{
+	luxzombie.wait();
+	zombiesound[0].wait();
+	zombiesound[1].wait();
+}
+
+void move_zombies(const vec3 &player, double dt)
+{
 	FOR_EACH(std::list<Zombie>, a, zombies) {
 		FOR_EACH(std::list<Zombie>, b, zombies) {
 			if (a == b)
@@ -138,7 +162,7 @@ void move_zombies(const vec3 &player, double dt)
 
 		if (uniform() < dt * 0.1) {
 			vec3 d = player - zombie->pos;
-			play_sound(&zombiesound[rand() & 1],
+			play_sound(zombiesound[random_u64() & 1].get(),
 				   std::min(1000 / dot(d, d), 5.0));
 		}
 
@@ -148,7 +172,7 @@ void move_zombies(const vec3 &player, double dt)
 		}
 		if (zombie->on_ground) {
 			if (zombie->fly_anim > 0) {
-				play_sound(&zombiesound[rand() & 1]);
+				play_sound(zombiesound[random_u64() & 1].get());
 			}
 			zombie->fly_anim = 0;
 		} else {
@@ -186,12 +210,26 @@ void throw_zombie(Zombie *zombie)
 
 void draw_zombies(const vec3 &player)
 {
-	static Model luxzombie;
-	if (luxzombie.empty()) {
-		luxzombie.load("luxzombie.obj", 2);
+	if (radius == 0 && !luxzombie->empty()) {
+		const AABB &bounds = luxzombie->bounds();
+		vec3 pivot(0, 4, 0);
+		radius = length((bounds.min + bounds.max) * 0.5 - pivot) +
+			 length(bounds.max - bounds.min) * 0.5;
 	}
 
+	Frustum frustum;
+	extract_frustum(&frustum, projMatrix, modelMatrix);
+
 	FOR_EACH_CONST(std::list<Zombie>, zombie, zombies) {
+		AABB box;
+		box.min = zombie->pos - vec3(radius, radius, radius);
+		box.max = zombie->pos + vec3(radius, radius, radius);
+		if (!box_visible(&frustum, box)) {
+			cull_stats.zombies_culled++;
+			continue;
+		}
+		cull_stats.zombies_drawn++;
+
 		glPushMatrix();
 		glTranslatef(zombie->pos.x, zombie->pos.y, zombie->pos.z);
 		vec3 d = player - zombie->pos;
@@ -202,7 +240,7 @@ void draw_zombies(const vec3 &player)
 			glRotatef(zombie->fly_anim, 0, 1, 0);
 		}
 		glTranslatef(0, -4, 0);
-		luxzombie.draw(false);
+		luxzombie->draw();
 		glPopMatrix();
 	}
 }
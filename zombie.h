@@ -13,6 +13,10 @@ struct Zombie {
 extern std::list<Zombie> zombies;
 
 Zombie *get_selected_zombie();
+void load_zombies();
+void wait_zombies();
+/* Until the next load_zombies(), the cache may evict them */
+void release_zombies();
 void move_zombies(const vec3 &player, double dt);
 void throw_zombie(Zombie *zombie);
 void draw_zombies(const vec3 &player);